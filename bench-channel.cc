@@ -0,0 +1,260 @@
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "torrent/common.h"
+
+#include "torrent/shm/channel.h"
+#include "torrent/shm/segment.h"
+
+// Producer/consumer throughput between two threads on separate cores.
+//
+// The 'per-message' consumer uses read_header() and consume_header(), which load both offsets and
+// store the read offset for every record. The 'batched' consumer uses the read cursor, which only
+// touches the producer's cache line when the cached write offset is exhausted and stores the read
+// offset once per batch.
+//
+// The 'packed' run uses the batched consumer on a channel with 16 byte record alignment.
+//
+// The 'blocking' run uses the batched consumer, which sleeps in wait_readable() instead of
+// yielding, with the producer calling notify_readable() after each write.
+//
+// The layout runs isolate the offset layout from the record format, using a minimal ring of
+// fixed size slots. 'adjacent' keeps both offsets on one cache line as Channel did before the
+// producer and consumer state were split, 'split' moves them to separate cache lines, and
+// 'split+cached' also keeps a local copy of the other side's offset as Channel does now.
+
+constexpr uint32_t message_count = 10'000'000;
+constexpr uint32_t segment_pages = 64;
+
+void
+pin_thread(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % std::thread::hardware_concurrency(), &set);
+
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+template <typename Consumer>
+double
+run_benchmark(torrent::shm::Channel* channel, uint32_t message_size, Consumer consumer, bool blocking = false) {
+  std::vector<char> message(message_size);
+
+  auto start_time = std::chrono::steady_clock::now();
+
+  std::thread producer([&]() {
+      pin_thread(0);
+
+      for (uint32_t i = 0; i < message_count; ) {
+        std::memcpy(message.data(), &i, sizeof(i));
+
+        if (!channel->write(1, message_size, message.data())) {
+          std::this_thread::yield();
+          continue;
+        }
+
+        if (blocking)
+          channel->notify_readable();
+
+        i++;
+      }
+    });
+
+  pin_thread(1);
+
+  uint32_t expected = 0;
+
+  while (expected < message_count) {
+    if (consumer(channel, expected))
+      continue;
+
+    if (blocking)
+      channel->wait_readable(std::chrono::milliseconds(1));
+    else
+      std::this_thread::yield();
+  }
+
+  producer.join();
+
+  auto duration = std::chrono::steady_clock::now() - start_time;
+
+  return std::chrono::duration<double, std::nano>(duration).count() / message_count;
+}
+
+template <bool Split, bool Cached>
+struct LayoutRing {
+  static constexpr uint32_t slot_count = 4096;
+  static constexpr size_t   alignment  = Split ? torrent::shm::Channel::cache_line_size : alignof(uint32_t);
+
+  bool write(uint32_t value) {
+    auto offset = write_offset.load(std::memory_order_relaxed);
+
+    if (!Cached || offset - cached_read_offset == slot_count) {
+      cached_read_offset = read_offset.load(std::memory_order_acquire);
+
+      if (offset - cached_read_offset == slot_count)
+        return false;
+    }
+
+    slots[offset % slot_count] = value;
+    write_offset.store(offset + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool read(uint32_t& value) {
+    auto offset = read_offset.load(std::memory_order_relaxed);
+
+    if (!Cached || offset == cached_write_offset) {
+      cached_write_offset = write_offset.load(std::memory_order_acquire);
+
+      if (offset == cached_write_offset)
+        return false;
+    }
+
+    value = slots[offset % slot_count];
+    read_offset.store(offset + 1, std::memory_order_release);
+    return true;
+  }
+
+  align_cacheline    std::atomic<uint32_t> write_offset{};
+  alignas(alignment) uint32_t              cached_read_offset{};
+  alignas(alignment) std::atomic<uint32_t> read_offset{};
+  alignas(alignment) uint32_t              cached_write_offset{};
+
+  align_cacheline    uint32_t              slots[slot_count]{};
+};
+
+template <typename Ring>
+double
+run_layout_benchmark() {
+  auto ring       = std::make_unique<Ring>();
+  auto start_time = std::chrono::steady_clock::now();
+
+  std::thread producer([&]() {
+      pin_thread(0);
+
+      for (uint32_t i = 0; i < message_count; ) {
+        if (!ring->write(i)) {
+          std::this_thread::yield();
+          continue;
+        }
+
+        i++;
+      }
+    });
+
+  pin_thread(1);
+
+  for (uint32_t expected = 0; expected < message_count; ) {
+    uint32_t value;
+
+    if (!ring->read(value)) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    if (value != expected)
+      throw std::runtime_error("run_layout_benchmark(): out of order message");
+
+    expected++;
+  }
+
+  producer.join();
+
+  auto duration = std::chrono::steady_clock::now() - start_time;
+
+  return std::chrono::duration<double, std::nano>(duration).count() / message_count;
+}
+
+bool
+consume_per_message(torrent::shm::Channel* channel, uint32_t& expected) {
+  auto header = channel->read_header();
+
+  if (header == nullptr)
+    return false;
+
+  if (std::memcmp(header->data, &expected, sizeof(expected)) != 0)
+    throw std::runtime_error("consume_per_message(): out of order message");
+
+  expected++;
+
+  channel->consume_header(header);
+  return true;
+}
+
+bool
+consume_batched(torrent::shm::Channel* channel, uint32_t& expected) {
+  auto cursor = channel->begin_read();
+  auto start  = expected;
+
+  while (auto header = channel->cursor_read(cursor)) {
+    if (std::memcmp(header->data, &expected, sizeof(expected)) != 0)
+      throw std::runtime_error("consume_batched(): out of order message");
+
+    expected++;
+
+    channel->cursor_consume(cursor, header);
+  }
+
+  channel->end_read(cursor);
+  return expected != start;
+}
+
+int
+main() {
+  std::cout << "sizeof(Channel): " << sizeof(torrent::shm::Channel) << std::endl;
+  std::cout << "messages: " << message_count << " channel: " << segment_pages * torrent::shm::Segment::page_size << " bytes" << std::endl << std::endl;
+
+  std::cout << std::setw(8) << "size" << std::setw(20) << "per-message ns/msg" << std::setw(16) << "batched ns/msg" << std::setw(16) << "packed ns/msg" << std::setw(18) << "blocking ns/msg" << std::endl;
+
+  for (uint32_t message_size : {8u, 56u, 248u, 1016u}) {
+    torrent::shm::Segment segment;
+    segment.create(segment_pages * torrent::shm::Segment::page_size);
+
+    auto channel = static_cast<torrent::shm::Channel*>(segment.address());
+
+    channel->initialize(segment.address(), segment.size());
+    auto per_message = run_benchmark(channel, message_size, consume_per_message);
+
+    channel->initialize(segment.address(), segment.size());
+    auto batched = run_benchmark(channel, message_size, consume_batched);
+
+    channel->initialize(segment.address(), segment.size(), 0, 16);
+    auto packed = run_benchmark(channel, message_size, consume_batched);
+
+    channel->initialize(segment.address(), segment.size());
+    auto blocking = run_benchmark(channel, message_size, consume_batched, true);
+
+    segment.destroy();
+
+    std::cout << std::setw(8) << message_size
+              << std::setw(20) << std::fixed << std::setprecision(1) << per_message
+              << std::setw(16) << std::fixed << std::setprecision(1) << batched
+              << std::setw(16) << std::fixed << std::setprecision(1) << packed
+              << std::setw(18) << std::fixed << std::setprecision(1) << blocking << std::endl;
+  }
+
+  std::cout << std::endl << std::setw(16) << "adjacent ns/msg" << std::setw(16) << "split ns/msg" << std::setw(22) << "split+cached ns/msg" << std::endl;
+
+  auto adjacent     = run_layout_benchmark<LayoutRing<false, false>>();
+  auto split        = run_layout_benchmark<LayoutRing<true, false>>();
+  auto split_cached = run_layout_benchmark<LayoutRing<true, true>>();
+
+  std::cout << std::setw(16) << std::fixed << std::setprecision(1) << adjacent
+            << std::setw(16) << std::fixed << std::setprecision(1) << split
+            << std::setw(22) << std::fixed << std::setprecision(1) << split_cached << std::endl;
+
+  return 0;
+}
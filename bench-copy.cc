@@ -0,0 +1,81 @@
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+#include "torrent/common.h"
+
+#include "torrent/shm/copy.h"
+
+// Finds the payload size where non-temporal copies start to pay off.
+//
+// Each iteration copies one payload into a destination ring much larger than the last level
+// cache, the way a producer fills a channel, and then walks a hot working set that the producer
+// would normally keep cached. Regular stores evict the working set for large payloads, streaming
+// stores leave it in place. Use the crossover to pick the value for set_streaming_threshold().
+
+constexpr size_t ring_size    = 256 * 1024 * 1024;
+constexpr size_t working_size = 512 * 1024;
+constexpr size_t total_bytes  = size_t{4} * 1024 * 1024 * 1024;
+
+using copy_func = void (*)(void* dest, const void* src, size_t size);
+
+uint64_t g_checksum{};
+
+double
+run_benchmark(char* ring, const char* payload, size_t payload_size, char* working_set, copy_func copy) {
+  size_t iterations = std::max<size_t>(total_bytes / payload_size, 64);
+  size_t offset     = 0;
+
+  auto start_time = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < iterations; i++) {
+    if (offset + payload_size > ring_size)
+      offset = 0;
+
+    copy(ring + offset, payload, payload_size);
+    offset += payload_size;
+
+    for (size_t j = 0; j < working_size; j += 64)
+      g_checksum += working_set[j]++;
+  }
+
+  auto duration = std::chrono::steady_clock::now() - start_time;
+
+  return std::chrono::duration<double, std::micro>(duration).count() / iterations;
+}
+
+void
+copy_regular(void* dest, const void* src, size_t size) {
+  std::memcpy(dest, src, size);
+}
+
+int
+main() {
+  auto ring        = std::make_unique<char[]>(ring_size);
+  auto payload     = std::make_unique<char[]>(ring_size / 8);
+  auto working_set = std::make_unique<char[]>(working_size);
+
+  std::memset(ring.get(), 1, ring_size);
+  std::memset(payload.get(), 2, ring_size / 8);
+  std::memset(working_set.get(), 3, working_size);
+
+  std::cout << "streaming kernel: " << torrent::shm::streaming_kernel_name() << std::endl;
+  std::cout << "working set: " << working_size / 1024 << " KiB" << std::endl << std::endl;
+
+  std::cout << std::setw(12) << "size" << std::setw(16) << "memcpy us/op" << std::setw(18) << "streaming us/op" << std::endl;
+
+  for (size_t payload_size = 4 * 1024; payload_size <= ring_size / 8; payload_size *= 4) {
+    auto regular   = run_benchmark(ring.get(), payload.get(), payload_size, working_set.get(), copy_regular);
+    auto streaming = run_benchmark(ring.get(), payload.get(), payload_size, working_set.get(), torrent::shm::copy_streaming);
+
+    std::cout << std::setw(12) << payload_size
+              << std::setw(16) << std::fixed << std::setprecision(2) << regular
+              << std::setw(18) << std::fixed << std::setprecision(2) << streaming
+              << (streaming < regular ? "  *" : "") << std::endl;
+  }
+
+  std::cout << std::endl << "checksum: " << g_checksum << std::endl;
+  return 0;
+}
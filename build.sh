@@ -10,17 +10,43 @@ source_files=(
   torrent/event.cc
   torrent/shm/channel.cc
   torrent/shm/control_fd.cc
+  torrent/shm/copy.cc
+  torrent/shm/doorbell.cc
   torrent/shm/factory.cc
   torrent/shm/router.cc
+  torrent/shm/router_group.cc
   torrent/shm/segment.cc
+  torrent/system/poll_epoll.cc
   torrent/system/poll_kqueue.cc
+  torrent/system/poll_uring.cc
 )
 
+bench_files=(
+  exceptions.cc
+  torrent/shm/channel.cc
+  torrent/shm/copy.cc
+  torrent/shm/segment.cc
+)
+
+case "$(uname -s)" in
+  Linux)
+    # Set POLL_BACKEND=io_uring to use io_uring instead of epoll.
+    if [ "${POLL_BACKEND:-epoll}" = "io_uring" ]; then
+      poll_backend=-DUSE_IO_URING
+    else
+      poll_backend=-DUSE_EPOLL
+    fi
+    ;;
+  *)
+    poll_backend=-DUSE_KQUEUE
+    ;;
+esac
+
 compile_args=(
   -I.
   -I/opt/local/include
 
-  -DUSE_KQUEUE
+  "${poll_backend}"
   -DLT_SMP_CACHE_BYTES=64
   -DDEBUG
 
@@ -32,6 +58,14 @@ compile_args=(
   -O0
 )
 
-clang++ -std=c++20 -g "${compile_args[@]}" -o test "${source_files[@]}"
+"${CXX:-clang++}" -std=c++20 -g "${compile_args[@]}" -o test "${source_files[@]}"
 
 chmod +x test
+
+"${CXX:-clang++}" -std=c++20 -g "${compile_args[@]/-O0/-O2}" -o bench-channel bench-channel.cc "${bench_files[@]}"
+
+chmod +x bench-channel
+
+"${CXX:-clang++}" -std=c++20 -g "${compile_args[@]/-O0/-O2}" -o bench-copy bench-copy.cc torrent/shm/copy.cc
+
+chmod +x bench-copy
@@ -16,14 +16,18 @@
 
 struct ChildHandler {
   void on_read(void* data, uint32_t size);
+  void on_new_channel(uint32_t new_id);
 
   void on_error(void* data, uint32_t size) {
     std::cout << "CHILD:HANDLER: received error:   id:" << id << " size:" << size << " : " << std::string(static_cast<char*>(data), size) << std::endl;
     throw std::runtime_error("CHILD:HANDLER throwing error as test");
   }
 
+  void on_writable() { write_blocked = false; }
+
   torrent::shm::Router*     router;
   uint32_t                  id;
+  bool                      write_blocked{};
   std::vector<TestHandler*> channels;
 };
 
@@ -34,24 +38,27 @@ ChildHandler::on_read(void* data, uint32_t size) {
     return;
   }
 
-  // Add a new channel id:
-  if (size != sizeof(NewChannelMessage))
-    throw std::runtime_error("CHILD:HANDLER: received message with invalid size for new channel message");
+  throw std::runtime_error("CHILD:HANDLER: received unexpected message");
+}
 
-  auto* msg = static_cast<NewChannelMessage*>(data);
-  std::cout << "CHILD:HANDLER: received new channel message with id: " << msg->id << std::endl;
+void
+ChildHandler::on_new_channel(uint32_t new_id) {
+  std::cout << "CHILD:HANDLER: received first message for new channel with id: " << new_id << std::endl;
 
   auto handler = new TestHandler{};
-  handler->id = msg->id;
+  handler->id = new_id;
 
   channels.push_back(handler);
 
   router->register_handler(handler->id,
-                           [handler](void* data, uint32_t size) { handler->on_read(data, size); },
-                           [handler](void* data, uint32_t size) { handler->on_error(data, size); });
+                           torrent::shm::RouterCallback::bind<&TestHandler::on_read>(handler),
+                           torrent::shm::RouterCallback::bind<&TestHandler::on_error>(handler));
 }
 
 
+using child_routes = torrent::shm::RouterRouteTable<ChildHandler,
+                                                    torrent::shm::RouterRoute<1, &ChildHandler::on_read>>;
+
 //
 // Child process:
 //
@@ -78,9 +85,10 @@ child_process(torrent::shm::Router* router) {
   child_handler->id = 1;
   child_handler->router = router;
 
-  router->register_handler(1,
-                           [child_handler](void* data, uint32_t size) { child_handler->on_read(data, size); },
-                           [child_handler](void* data, uint32_t size) { child_handler->on_error(data, size); });
+  router->set_static_routes<child_routes>(child_handler);
+  router->set_handler_factory(torrent::shm::RouterHandlerFactory::bind<&ChildHandler::on_new_channel>(child_handler));
+  router->set_writable_handler(torrent::shm::RouterWritableCallback::bind<&ChildHandler::on_writable>(child_handler));
+  router->set_spin_policy(torrent::shm::RouterSpinPolicy{50us});
 
   std::chrono::steady_clock::time_point shutdown_timestamp{};
 
@@ -138,7 +146,7 @@ child_process(torrent::shm::Router* router) {
 
       // std::cout << "CHILD: checking for message..." << std::endl;
 
-      if (std::chrono::steady_clock::now() - last_write > message_interval) {
+      if (!child_handler->write_blocked && std::chrono::steady_clock::now() - last_write > message_interval) {
         std::cout << "CHILD: writing message..." << std::endl;
 
         if (child_handler->channels.empty()) {
@@ -155,7 +163,9 @@ child_process(torrent::shm::Router* router) {
           // while (!router->write(id, strlen(message) + 1, (void*)message)) {
           if (!router->write(id, strlen(message), (void*)message)) {
             std::cout << "CHILD: channel full, waiting..." << std::endl;
-            std::this_thread::sleep_for(100ms);
+
+            child_handler->write_blocked = true;
+            router->request_writable();
 
             i--;
 
@@ -176,7 +186,7 @@ child_process(torrent::shm::Router* router) {
       // Thread:
       //
 
-      router->process_reads_pre_polling();
+      bool has_backlog = router->process_reads_pre_polling();
 
       // TODO: Add a sleep here to test flags for avoiding interrupts.
 
@@ -184,9 +194,13 @@ child_process(torrent::shm::Router* router) {
 
       // std::cout << "CHILD: calculated timeout: " << std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count() << " ms" << std::endl;
 
-      if (timeout < std::chrono::steady_clock::duration::zero())
+      if (timeout < std::chrono::steady_clock::duration::zero() || has_backlog)
         timeout = std::chrono::steady_clock::duration::zero();
 
+      // Wait for the writable notification instead of retrying.
+      if (child_handler->write_blocked && !has_backlog)
+        timeout = message_interval;
+
       // if (!m_scheduler->empty())
       //   timeout = std::min(timeout, m_scheduler->next_timeout());
 
@@ -210,6 +224,9 @@ child_process(torrent::shm::Router* router) {
     throw;
   }
 
+  std::cout << "CHILD: spin hit rate: " << router->spin_stats().hit_rate()
+            << " hits:" << router->spin_stats().hits << " misses:" << router->spin_stats().misses << std::endl;
+
   router->test_close_control_fd();
   torrent::this_thread::poll()->cleanup_thread();
 }
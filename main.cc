@@ -1,9 +1,11 @@
 #include <chrono>
+#include <csignal>
 #include <execinfo.h>
 #include <fcntl.h>
 #include <iostream>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <thread>
 #include <unistd.h>
 
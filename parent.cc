@@ -10,6 +10,7 @@
 #include "torrent/shm/control_fd.h"
 #include "torrent/shm/channel.h"
 #include "torrent/shm/router.h"
+#include "torrent/shm/router_group.h"
 #include "torrent/shm/segment.h"
 
 struct ParentHandler {
@@ -27,31 +28,32 @@ struct ParentHandler {
     throw std::runtime_error("PARENT:HANDLER: throwing error as test");
   }
 
+  void on_writable() { write_blocked = false; }
+
   TestHandler* create_new_channel(torrent::shm::Router* router);
 
   uint32_t id;
+  bool     write_blocked{};
 };
 
 TestHandler*
 ParentHandler::create_new_channel(torrent::shm::Router* router) {
   auto handler = new TestHandler{};
 
-  handler->id = router->register_handler([handler](void* data, uint32_t size) { handler->on_read(data, size); },
-                                         [handler](void* data, uint32_t size) { handler->on_error(data, size); });
+  handler->id = router->register_handler(torrent::shm::RouterCallback::bind<&TestHandler::on_read>(handler),
+                                         torrent::shm::RouterCallback::bind<&TestHandler::on_error>(handler));
 
   std::cout << "PARENT:HANDLER: created new channel with id: " << handler->id << std::endl;
 
-  // Send a message to ChildHandler to tell it the id of this new channel.
-
-  NewChannelMessage msg;
-  msg.id = handler->id;
-
-  if (!router->write(id, sizeof(msg), &msg))
-    throw std::runtime_error("PARENT:HANDLER: failed to send new channel message");
+  // The child registers the id from its handler factory when the first message arrives, so the
+  // channel can be written to right away.
 
   return handler;
 }
 
+using parent_routes = torrent::shm::RouterRouteTable<ParentHandler,
+                                                     torrent::shm::RouterRoute<1, &ParentHandler::on_read>>;
+
 //
 // Parent process:
 //
@@ -78,9 +80,13 @@ parent_process(torrent::shm::Router* router) {
   auto parent_handler = new ParentHandler{};
   parent_handler->id = 1;
 
-  router->register_handler(1,
-                           [parent_handler](void* data, uint32_t size) { parent_handler->on_read(data, size); },
-                           [parent_handler](void* data, uint32_t size) { parent_handler->on_error(data, size); });
+  router->set_static_routes<parent_routes>(parent_handler);
+  router->set_writable_handler(torrent::shm::RouterWritableCallback::bind<&ParentHandler::on_writable>(parent_handler));
+
+  // The parent would hold one router per child in the group.
+  torrent::shm::RouterGroup router_group;
+  router_group.insert(router);
+  router_group.set_spin_policy(torrent::shm::RouterSpinPolicy{50us});
 
   auto handler_1 = parent_handler->create_new_channel(router);
   auto handler_2 = parent_handler->create_new_channel(router);
@@ -130,7 +136,7 @@ parent_process(torrent::shm::Router* router) {
 
       // std::cout << "PARENT: checking for message..." << std::endl;
 
-      if (std::chrono::steady_clock::now() - last_write > message_interval) {
+      if (!parent_handler->write_blocked && std::chrono::steady_clock::now() - last_write > message_interval) {
         std::cout << "PARENT: writing message..." << std::endl;
 
         uint32_t id = (i % 2 == 0) ? handler_1->id : handler_2->id;
@@ -139,7 +145,9 @@ parent_process(torrent::shm::Router* router) {
 
         if (!router->write(id, strlen(message), (void*)message)) {
           std::cout << "PARENT: channel full, waiting..." << std::endl;
-          std::this_thread::sleep_for(100ms);
+
+          parent_handler->write_blocked = true;
+          router->request_writable();
 
           i--;
 
@@ -158,18 +166,18 @@ parent_process(torrent::shm::Router* router) {
       // Thread:
       //
 
-      router->process_reads_pre_polling();
-
       auto timeout = message_interval - (std::chrono::steady_clock::now() - last_write);
 
       if (timeout < std::chrono::steady_clock::duration::zero())
         timeout = std::chrono::steady_clock::duration::zero();
 
-      std::cout << "PARENT: polling for events with timeout: " << std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count() << "ms" << std::endl;
+      // Wait for the writable notification instead of retrying.
+      if (parent_handler->write_blocked)
+        timeout = message_interval;
 
-      [[maybe_unused]] int event_count = torrent::this_thread::poll()->do_poll(std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
+      std::cout << "PARENT: polling for events with timeout: " << std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count() << "ms" << std::endl;
 
-      router->process_reads_post_polling();
+      [[maybe_unused]] int event_count = router_group.poll(std::chrono::duration_cast<std::chrono::microseconds>(timeout));
 
       if (event_count > 0) {
         std::cout << "PARENT: poll returned with event count: " << event_count << std::endl;
@@ -185,6 +193,9 @@ parent_process(torrent::shm::Router* router) {
     throw;
   }
 
+  std::cout << "PARENT: spin hit rate: " << router_group.spin_stats().hit_rate()
+            << " hits:" << router_group.spin_stats().hits << " misses:" << router_group.spin_stats().misses << std::endl;
+
   router->test_close_control_fd();
   torrent::this_thread::poll()->cleanup_thread();
 }
@@ -31,10 +31,6 @@ void register_signal_shutdown();
 // Common definitions for parent and child process.
 //
 
-struct NewChannelMessage {
-  uint32_t id;
-};
-
 struct TestHandler {
   void on_read(void* data, uint32_t size);
   void on_error(void* data, uint32_t size);
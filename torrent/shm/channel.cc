@@ -3,38 +3,119 @@
 #include "torrent/shm/channel.h"
 
 #include <algorithm>
+#include <cerrno>
 #include <cstring>
+#include <limits>
 #include <new>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include "torrent/exceptions.h"
+#include "torrent/shm/copy.h"
+#include "torrent/shm/segment.h"
 
 namespace torrent::shm {
 
-constexpr uint32_t
-align_to_cacheline(uint32_t size) {
-  uint32_t cache_line_size = LT_SMP_CACHE_BYTES;
+constexpr size_t
+align_to_cacheline(size_t size) {
+  size_t cache_line_size = LT_SMP_CACHE_BYTES;
 
   return (size + (cache_line_size - 1)) & ~(cache_line_size - 1);
 }
 
+// The futex word is in a shared segment, so the private futex operations can't be used. A timeout
+// of nanoseconds::max() waits until woken.
+static void
+futex_wait(std::atomic<uint32_t>* word, uint32_t expected, std::chrono::nanoseconds timeout) {
+#ifdef __linux__
+  auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+
+  struct timespec ts{};
+  ts.tv_sec  = seconds.count();
+  ts.tv_nsec = (timeout - seconds).count();
+
+  auto ts_ptr = timeout != std::chrono::nanoseconds::max() ? &ts : nullptr;
+
+  if (::syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, ts_ptr, nullptr, 0) == -1 &&
+      errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+    throw torrent::internal_error("Channel::wait_readable(): futex wait failed: " + std::string(std::strerror(errno)));
+#else
+  std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(timeout, std::chrono::microseconds(50)));
+#endif
+}
+
+static void
+futex_wake(std::atomic<uint32_t>* word) {
+#ifdef __linux__
+  if (::syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, 1, nullptr, nullptr, 0) == -1)
+    throw torrent::internal_error("Channel::notify_readable(): futex wake failed: " + std::string(std::strerror(errno)));
+#endif
+}
+
+template <typename Offset>
 void
-Channel::initialize(void* addr, size_t size) {
+BasicChannel<Offset>::initialize(void* addr, size_t size, int options, uint32_t record_alignment) {
+  bool mirrored   = (options & option_mirrored);
+  bool slot_flags = (options & option_slot_flags);
+
+  if (slot_flags && !mirrored)
+    throw torrent::internal_error("Channel::initialize() slot flags requires a mirrored channel");
+
   if (size == 0 || (size % std::hardware_destructive_interference_size) != 0)
     throw torrent::internal_error("Channel::initialize() size must be non-zero and a multiple of cache line size");
 
-  m_addr            = static_cast<char*>(addr) + align_to_cacheline(sizeof(Channel));
-  m_size            = size - align_to_cacheline(sizeof(Channel));
+  if (record_alignment < header_size || record_alignment > cache_line_size || (record_alignment & (record_alignment - 1)) != 0)
+    throw torrent::internal_error("Channel::initialize() record alignment must be a power of two between header size and cache line size");
+
+  // Mirrored segments map the data area a second time right after the end of the segment, so it
+  // must start on a page boundary.
+  size_t data_offset = mirrored ? Segment::page_size : align_to_cacheline(sizeof(BasicChannel));
+
+  if (sizeof(BasicChannel) > data_offset || size <= data_offset)
+    throw torrent::internal_error("Channel::initialize() size too small");
+
+  if (size - data_offset > std::numeric_limits<offset_type>::max() / (mirrored ? 2 : 1) - cache_line_size)
+    throw torrent::internal_error("Channel::initialize() size too large for offset type, use Channel64");
+
+  m_addr            = static_cast<char*>(addr) + data_offset;
+  m_size            = size - data_offset;
+  m_mirrored        = mirrored;
+  m_slot_flags      = slot_flags;
+
+  m_record_alignment = record_alignment;
   m_write_threshold = align_to_cacheline(m_size / 10) + 2 * cache_line_size;
 
+  // The consumer starts polling the first header, which must not be a stale record.
+  header_at(0)->size = 0;
+  header_at(0)->id   = 0;
+
   m_read_offset  = 0;
   m_write_offset = 0;
+
+  m_consumer_state  = 0;
+  m_producer_state  = 0;
+  m_read_wait_state = 0;
+
+  m_cached_read_offset  = 0;
+  m_cached_write_offset = 0;
+
+  m_reserved = false;
 }
 
-uint32_t
-Channel::available_write() {
+template <typename Offset>
+Offset
+BasicChannel<Offset>::available_write() {
   // These are cacheline aligned atomic values.
-  uint32_t start_offset = m_read_offset.load(std::memory_order_acquire);
-  uint32_t end_offset   = m_write_offset.load(std::memory_order_acquire);
+  offset_type start_offset = m_read_offset.load(std::memory_order_acquire);
+  offset_type end_offset   = m_write_offset.load(std::memory_order_acquire);
+
+  if (m_mirrored)
+    return m_size - used_size(start_offset, end_offset);
 
   if (end_offset >= start_offset)
     return std::max(m_size - end_offset, start_offset);
@@ -42,45 +123,73 @@ Channel::available_write() {
   return start_offset - end_offset;
 }
 
+template <typename Offset>
 bool
-Channel::can_write(uint32_t size) {
-  return available_write() >= align_to_cacheline(header_size + size) + cache_line_size;
+BasicChannel<Offset>::can_write(uint32_t size) {
+  return available_write() >= align_record(header_size + size) + control_headroom + cache_line_size;
 }
 
-// TODO: Need to align writes?
+// The flag and the read offset are written by different sides and each side loads the other's
+// value, so both sides need a full fence between their store and load. The consumer's fence is
+// in Router's pre-polling, which is always reached before it sleeps.
 
+template <typename Offset>
 bool
-Channel::write(uint32_t id, uint32_t size, void* data) {
-  if (id == 0)
-    throw torrent::internal_error("Channel::write() invalid id");
+BasicChannel<Offset>::request_writable() {
+  m_producer_state.fetch_or(flag_write_waiting, std::memory_order_seq_cst);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
 
-  if (size > m_size - header_size)
-    throw torrent::internal_error("Channel::write() invalid size");
+  if (available_write() < m_write_threshold)
+    return true;
+
+  m_producer_state.fetch_and(~flag_write_waiting, std::memory_order_relaxed);
+  return false;
+}
+
+template <typename Offset>
+bool
+BasicChannel<Offset>::release_writable() {
+  if (!(m_producer_state.load(std::memory_order_relaxed) & flag_write_waiting))
+    return false;
 
-  size_t total_size = align_to_cacheline(header_size + size);
+  if (available_write() < m_write_threshold)
+    return false;
 
-  // If we're wrapping around, add a padding header. (size == 0)
-  size_t start_offset = m_read_offset.load(std::memory_order_acquire);
-  size_t end_offset   = m_write_offset.load(std::memory_order_acquire);
+  return m_producer_state.fetch_and(~flag_write_waiting, std::memory_order_seq_cst) & flag_write_waiting;
+}
+
+// Returns the offset to write a record of 'total_size' bytes at, or invalid_offset if there is
+// not enough space.
+//
+// If we're wrapping around, add a padding header. (size == ~0) The padding header is written to
+// free space, so it is harmless if the write is never published.
 
+template <typename Offset>
+Offset
+BasicChannel<Offset>::find_write_offset(offset_type start_offset, offset_type end_offset, offset_type total_size) {
   // We keep a cache line free to distinguish full/empty.
 
-  if (end_offset < start_offset) {
+  if (m_mirrored) {
+    // Records may straddle the end of the data area, so all free space is usable.
+    if (m_size - used_size(start_offset, end_offset) < total_size + cache_line_size)
+      return invalid_offset;
+
+  } else if (end_offset < start_offset) {
     // We're in wrapped state.
     if (start_offset - end_offset < total_size + cache_line_size)
-      return false;
+      return invalid_offset;
 
   } else if (end_offset == m_size) {
     // At end, need to wrap.
     if (start_offset < total_size + cache_line_size)
-      return false;
+      return invalid_offset;
 
     end_offset = 0;
 
   } else if (m_size - end_offset < total_size) {
     // Not enough space at end, need to wrap.
     if (start_offset < total_size + cache_line_size)
-      return false;
+      return invalid_offset;
 
     auto padding_header = reinterpret_cast<header_type*>(static_cast<char*>(m_addr) + end_offset);
     padding_header->size = ~uint32_t{0};
@@ -88,34 +197,173 @@ Channel::write(uint32_t id, uint32_t size, void* data) {
 
     end_offset = 0;
 
+  } else if (start_offset == 0 && m_size - end_offset < total_size + cache_line_size) {
+    // Sufficient space at end, however the write offset would wrap to the read offset and make
+    // the channel appear empty.
+    return invalid_offset;
+
   } else {
     // Sufficient space at end.
   }
 
-  auto header = reinterpret_cast<header_type*>(static_cast<char*>(m_addr) + end_offset);
+  return end_offset;
+}
+
+// Returns the offset following a record, wrapping at the end of the data area.
+
+template <typename Offset>
+Offset
+BasicChannel<Offset>::advance_offset(offset_type offset, offset_type total_size) const {
+  offset += total_size;
+
+  if (offset < m_size)
+    return offset;
+
+  if (offset > m_size && !m_mirrored)
+    throw torrent::internal_error("Channel::advance_offset() offset exceeds buffer size");
+
+  return offset - m_size;
+}
+
+// Clear the header following the record before publishing it, so the consumer stops there. The
+// following header is always in free space as we keep a cache line free.
+
+template <typename Offset>
+void
+BasicChannel<Offset>::publish_record(offset_type offset, uint32_t id, offset_type next_offset) {
+  store_header_id(header_at(next_offset), 0);
+  store_header_id(header_at(offset), id);
+}
+
+// TODO: Need to align writes?
+
+template <typename Offset>
+bool
+BasicChannel<Offset>::write(uint32_t id, uint32_t size, void* data) {
+  void* buffer = reserve(id, size);
+
+  if (buffer == nullptr)
+    return false;
+
+  copy_payload(buffer, data, size);
+
+  commit(size);
+  return true;
+}
+
+template <typename Offset>
+void*
+BasicChannel<Offset>::reserve(uint32_t id, uint32_t max_size) {
+  return reserve_record(id, max_size, control_headroom);
+}
+
+template <typename Offset>
+bool
+BasicChannel<Offset>::write_control(uint32_t id, uint32_t size, void* data) {
+  void* buffer = reserve_control(id, size);
+
+  if (buffer == nullptr)
+    return false;
+
+  copy_payload(buffer, data, size);
+
+  commit(size);
+  return true;
+}
+
+template <typename Offset>
+void*
+BasicChannel<Offset>::reserve_control(uint32_t id, uint32_t max_size) {
+  return reserve_record(id, max_size, 0);
+}
+
+// The headroom is added to the space required, so at least that much contiguous free space follows
+// the record.
+template <typename Offset>
+void*
+BasicChannel<Offset>::reserve_record(uint32_t id, uint32_t max_size, offset_type headroom) {
+  if (m_reserved)
+    throw torrent::internal_error("Channel::reserve() reservation already active");
+
+  if (id == 0)
+    throw torrent::internal_error("Channel::reserve() invalid id");
+
+  if (max_size > m_size - header_size)
+    throw torrent::internal_error("Channel::reserve() invalid size");
+
+  offset_type total_size = align_record(header_size + max_size) + headroom;
+  offset_type end_offset = m_write_offset.load(std::memory_order_relaxed);
+  offset_type offset     = find_write_offset(m_cached_read_offset, end_offset, total_size);
+
+  if (offset == invalid_offset) {
+    // Looks full, refresh the cached read offset and retry.
+    m_cached_read_offset = m_read_offset.load(std::memory_order_acquire);
+    offset = find_write_offset(m_cached_read_offset, end_offset, total_size);
+
+    if (offset == invalid_offset)
+      return nullptr;
+  }
+
+  m_reserved        = true;
+  m_reserved_offset = offset;
+  m_reserved_size   = max_size;
+  m_reserved_id     = id;
+
+  return header_at(offset)->data;
+}
+
+template <typename Offset>
+void
+BasicChannel<Offset>::commit(uint32_t size) {
+  if (!m_reserved)
+    throw torrent::internal_error("Channel::commit() no active reservation");
+
+  if (size > m_reserved_size)
+    throw torrent::internal_error("Channel::commit() size exceeds reserved size");
+
+  auto header = header_at(m_reserved_offset);
   header->size = size;
-  header->id   = id;
 
-  size_t new_end_offset = end_offset + total_size;
+  offset_type new_end_offset = advance_offset(m_reserved_offset, align_record(header_size + size));
+
+  m_reserved = false;
 
-  if (new_end_offset > m_size)
-    throw torrent::internal_error("Channel::write() new_end_offset exceeds buffer size");
+  if (m_slot_flags) {
+    publish_record(m_reserved_offset, m_reserved_id, new_end_offset);
 
-  if (new_end_offset == m_size)
-    new_end_offset = 0;
+    // Only used by the producer.
+    m_write_offset.store(new_end_offset, std::memory_order_relaxed);
+    return;
+  }
 
-  std::memcpy(header->data, data, size);
+  header->id = m_reserved_id;
 
   m_write_offset.store(new_end_offset, std::memory_order_release);
+}
 
-  std::atomic_thread_fence(std::memory_order_release);
-  return true;
+template <typename Offset>
+void
+BasicChannel<Offset>::abort() {
+  if (!m_reserved)
+    throw torrent::internal_error("Channel::abort() no active reservation");
+
+  m_reserved = false;
 }
 
-Channel::header_type*
-Channel::read_header() {
-  size_t start_offset = m_read_offset.load(std::memory_order_acquire);
-  size_t end_offset   = m_write_offset.load(std::memory_order_acquire);
+template <typename Offset>
+typename BasicChannel<Offset>::header_type*
+BasicChannel<Offset>::read_header() {
+  if (m_slot_flags) {
+    auto header = header_at(m_read_offset.load(std::memory_order_relaxed));
+
+    if (load_header_id(header) == 0)
+      return nullptr;
+
+    return header;
+  }
+
+  offset_type start_offset = m_read_offset.load(std::memory_order_acquire);
+  offset_type end_offset   = m_write_offset.load(std::memory_order_acquire);
 
   if (start_offset == end_offset)
     return nullptr;
@@ -139,24 +387,268 @@ Channel::read_header() {
       throw torrent::internal_error("Channel::read_header() consecutive padding headers");
   }
 
-  if (header->data + header->size > static_cast<char*>(m_addr) + m_size)
+  if (header->data + header->size > static_cast<char*>(m_addr) + data_area_size())
     throw torrent::internal_error("Channel::read_header() header size exceeds buffer size");
 
   return header;
 }
 
+template <typename Offset>
 void
-Channel::consume_header(header_type* header) {
-  size_t header_offset    = reinterpret_cast<char*>(header) - static_cast<char*>(m_addr);
-  size_t new_start_offset = header_offset + align_to_cacheline(header_size + header->size);
+BasicChannel<Offset>::consume_header(header_type* header) {
+  offset_type header_offset    = reinterpret_cast<char*>(header) - static_cast<char*>(m_addr);
+  offset_type new_start_offset = advance_offset(header_offset, align_record(header_size + header->size));
+
+  m_read_offset.store(new_start_offset, std::memory_order_release);
+}
 
-  if (new_start_offset > m_size)
-    throw torrent::internal_error("Channel::consume_header() new_start_offset exceeds buffer size");
+template <typename Offset>
+bool
+BasicChannel<Offset>::is_readable() const {
+  if (m_slot_flags)
+    return load_header_id(header_at(m_read_offset.load(std::memory_order_relaxed))) != 0;
 
-  if (new_start_offset == m_size)
-    new_start_offset = 0;
+  return m_read_offset.load(std::memory_order_relaxed) != m_write_offset.load(std::memory_order_relaxed);
+}
 
-  m_read_offset.store(new_start_offset, std::memory_order_release);
+// The consumer sets the waiting flag and the producer publishes records before checking the other
+// side's value, so both need a full fence between their store and load. The producer clears the
+// flag before waking, which also stops a consumer that is about to sleep.
+template <typename Offset>
+bool
+BasicChannel<Offset>::wait_readable(std::chrono::microseconds timeout) {
+  if (is_readable())
+    return true;
+
+  auto deadline = std::chrono::steady_clock::time_point::max();
+
+  if (timeout != std::chrono::microseconds::max())
+    deadline = std::chrono::steady_clock::now() + timeout;
+
+  while (true) {
+    m_read_wait_state.store(flag_read_waiting, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (is_readable())
+      break;
+
+    auto remaining = std::chrono::nanoseconds::max();
+
+    if (deadline != std::chrono::steady_clock::time_point::max()) {
+      auto now = std::chrono::steady_clock::now();
+
+      if (now >= deadline)
+        break;
+
+      remaining = deadline - now;
+    }
+
+    futex_wait(&m_read_wait_state, flag_read_waiting, remaining);
+  }
+
+  m_read_wait_state.store(0, std::memory_order_relaxed);
+
+  // Records published before the producer's fence are visible after the acquire.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return is_readable();
+}
+
+template <typename Offset>
+void
+BasicChannel<Offset>::notify_readable() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if (m_read_wait_state.load(std::memory_order_relaxed) == 0)
+    return;
+
+  if (m_read_wait_state.exchange(0, std::memory_order_relaxed) == 0)
+    return;
+
+  futex_wake(&m_read_wait_state);
+}
+
+template <typename Offset>
+typename BasicChannel<Offset>::read_cursor
+BasicChannel<Offset>::begin_read() {
+  read_cursor cursor;
+
+  // Only the consumer modifies the read offset, so it does not need to be synchronized.
+  cursor.start_offset = m_read_offset.load(std::memory_order_relaxed);
+  cursor.end_offset   = m_cached_write_offset;
+  cursor.offset       = cursor.start_offset;
+
+  return cursor;
+}
+
+template <typename Offset>
+typename BasicChannel<Offset>::header_type*
+BasicChannel<Offset>::cursor_read(read_cursor& cursor) {
+  if (m_slot_flags) {
+    auto header = header_at(cursor.offset);
+
+    if (load_header_id(header) == 0)
+      return nullptr;
+
+    if (header->data + header->size > static_cast<char*>(m_addr) + data_area_size())
+      throw torrent::internal_error("Channel::cursor_read() header size exceeds buffer size");
+
+    __builtin_prefetch(header_at(advance_offset(cursor.offset, align_record(header_size + header->size))), 0, 3);
+    return header;
+  }
+
+  if (cursor.offset == cursor.end_offset) {
+    // Looks empty, refresh the cached write offset.
+    m_cached_write_offset = m_write_offset.load(std::memory_order_acquire);
+    cursor.end_offset     = m_cached_write_offset;
+
+    if (cursor.offset == cursor.end_offset)
+      return nullptr;
+  }
+
+  auto header = reinterpret_cast<header_type*>(static_cast<char*>(m_addr) + cursor.offset);
+
+  if (header->size == ~uint32_t{0}) {
+    // Padding header, wrap around.
+    if (cursor.offset < cursor.end_offset)
+      throw torrent::internal_error("Channel::cursor_read() padding header but no wrap");
+
+    cursor.offset = 0;
+    header = static_cast<header_type*>(m_addr);
+
+    if (cursor.offset == cursor.end_offset)
+      throw torrent::internal_error("Channel::cursor_read() padding header but no data after wrap");
+
+    if (header->size == ~uint32_t{0})
+      throw torrent::internal_error("Channel::cursor_read() consecutive padding headers");
+  }
+
+  if (header->data + header->size > static_cast<char*>(m_addr) + data_area_size())
+    throw torrent::internal_error("Channel::cursor_read() header size exceeds buffer size");
+
+  // Prefetch the next record while the caller handles this one, the first two cache lines cover
+  // the header and the start of the payload.
+  size_t next_offset = cursor.offset + align_record(header_size + header->size);
+
+  if (next_offset != cursor.end_offset && next_offset < data_area_size()) {
+    auto next_addr = static_cast<char*>(m_addr) + next_offset;
+
+    __builtin_prefetch(next_addr, 0, 3);
+
+    if (next_offset + cache_line_size < data_area_size())
+      __builtin_prefetch(next_addr + cache_line_size, 0, 3);
+  }
+
+  return header;
+}
+
+template <typename Offset>
+void
+BasicChannel<Offset>::cursor_consume(read_cursor& cursor, header_type* header) {
+  offset_type header_offset = reinterpret_cast<char*>(header) - static_cast<char*>(m_addr);
+
+  if (header_offset != cursor.offset)
+    throw torrent::internal_error("Channel::cursor_consume() header is not at cursor offset");
+
+  cursor.offset = advance_offset(header_offset, align_record(header_size + header->size));
+}
+
+template <typename Offset>
+void
+BasicChannel<Offset>::end_read(read_cursor& cursor) {
+  if (cursor.offset == cursor.start_offset)
+    return;
+
+  m_read_offset.store(cursor.offset, std::memory_order_release);
+
+  cursor.start_offset = cursor.offset;
+}
+
+template <typename Offset>
+typename BasicChannel<Offset>::write_cursor
+BasicChannel<Offset>::begin_write() {
+  if (m_reserved)
+    throw torrent::internal_error("Channel::begin_write() reservation already active");
+
+  write_cursor cursor;
+
+  // Only the producer modifies the write offset, so it does not need to be synchronized.
+  cursor.start_offset = m_write_offset.load(std::memory_order_relaxed);
+  cursor.read_offset  = m_cached_read_offset;
+  cursor.offset       = cursor.start_offset;
+
+  return cursor;
+}
+
+template <typename Offset>
+bool
+BasicChannel<Offset>::cursor_write(write_cursor& cursor, uint32_t id, uint32_t size, void* data) {
+  if (id == 0)
+    throw torrent::internal_error("Channel::cursor_write() invalid id");
+
+  if (size > m_size - header_size)
+    throw torrent::internal_error("Channel::cursor_write() invalid size");
+
+  offset_type total_size = align_record(header_size + size);
+  offset_type offset     = find_write_offset(cursor.read_offset, cursor.offset, total_size + control_headroom);
+
+  if (offset == invalid_offset) {
+    // Looks full, refresh the cached read offset once before failing.
+    m_cached_read_offset = m_read_offset.load(std::memory_order_acquire);
+    cursor.read_offset   = m_cached_read_offset;
+
+    offset = find_write_offset(cursor.read_offset, cursor.offset, total_size + control_headroom);
+
+    if (offset == invalid_offset)
+      return false;
+  }
+
+  auto header = header_at(offset);
+  header->size = size;
+
+  copy_payload(header->data, data, size);
+
+  offset_type next_offset = advance_offset(offset, total_size);
+
+  if (!m_slot_flags) {
+    header->id = id;
+
+  } else if (cursor.pending_id == 0) {
+    // Hold back the first record so the whole batch becomes visible at once.
+    store_header_id(header_at(next_offset), 0);
+
+    cursor.pending_offset = offset;
+    cursor.pending_id     = id;
+
+  } else {
+    publish_record(offset, id, next_offset);
+  }
+
+  cursor.offset = next_offset;
+  return true;
+}
+
+template <typename Offset>
+void
+BasicChannel<Offset>::end_write(write_cursor& cursor) {
+  if (cursor.offset == cursor.start_offset)
+    return;
+
+  if (m_slot_flags) {
+    store_header_id(header_at(cursor.pending_offset), cursor.pending_id);
+
+    m_write_offset.store(cursor.offset, std::memory_order_relaxed);
+
+    cursor.start_offset = cursor.offset;
+    cursor.pending_id   = 0;
+    return;
+  }
+
+  m_write_offset.store(cursor.offset, std::memory_order_release);
+
+  cursor.start_offset = cursor.offset;
 }
 
+template class BasicChannel<uint32_t>;
+template class BasicChannel<uint64_t>;
+
 } // namespace torrent::shm
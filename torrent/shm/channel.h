@@ -2,6 +2,7 @@
 #define LIBTORRENT_TORRENT_SHM_CHANNEL_H
 
 #include <atomic>
+#include <chrono>
 #include <torrent/common.h>
 
 // Channels are intended for one writer, one reader, of data blocks less than ~1/10th the channel
@@ -9,11 +10,44 @@
 //
 // Querying available write space selects the largest of the contiguous free spaces, so when
 // wrapping the free space may be smaller than total free space.
+//
+// Records are cache line aligned by default. Channels used mostly for small messages may be
+// initialized with a smaller record alignment, down to the header size, which packs several
+// records per cache line. The alignment is stored in the shared channel state so both sides agree
+// on the record layout.
+//
+// Mirrored channels have the data area mapped twice back-to-back, so records may straddle the
+// end and no padding is needed. All free space is then usable for writes.
+//
+// The slot flags engine publishes each record through its header id instead of the write offset,
+// so the consumer only polls the next record's header and never loads the producer's cache line.
+// A zero id marks the end of the published records; the producer clears the following header
+// before publishing a record. It requires a mirrored segment, as padding records would need to be
+// published separately.
+//
+// Regular writes leave control_headroom bytes free after the record, which only control writes
+// may use. A small control record thus always fits after a successful regular write, so control
+// messages are not starved by a full channel.
+//
+// A producer that finds the channel full may request a writable notification. The consumer then
+// clears the request once at least the write threshold is free, and wakes the producer. The
+// request flag lives on the consumer's cache line as it is checked after every read batch, while
+// the producer only touches it when the channel is full.
+//
+// The producer and consumer state are kept on separate cache lines, and each side keeps a cached
+// copy of the other side's offset that is only refreshed when the channel looks full or empty.
+//
+// Channel uses 32-bit offsets, which limits the data area to 4 GiB. Channel64 uses 64-bit
+// offsets for multi-gigabyte segments, with the same record format; a single record is still
+// limited to 4 GiB.
 
 namespace torrent::shm {
 
-class LIBTORRENT_EXPORT Channel {
+template <typename Offset>
+class LIBTORRENT_EXPORT BasicChannel {
 public:
+  using offset_type = Offset;
+
   struct [[gnu::packed]] header_type {
     uint32_t    size{};
     uint32_t    id{};
@@ -23,43 +57,223 @@ public:
   static constexpr size_t   header_size     = sizeof(header_type);
   static constexpr size_t   cache_line_size = std::hardware_destructive_interference_size;
 
-  static constexpr uint32_t flag_polling = 0x1;
+  // Consumer state flags. The consumer sets flag_polling before it sleeps, and the producer sets
+  // flag_wakeup_pending when it wakes the consumer. Both are cleared when the consumer stores a new
+  // polling state.
+  static constexpr uint32_t flag_polling        = 0x1;
+  static constexpr uint32_t flag_wakeup_pending = 0x2;
+
+  static constexpr uint32_t flag_write_waiting  = 0x1;
+  static constexpr uint32_t flag_read_waiting   = 0x1;
+
+  static constexpr int      option_mirrored   = 0x1;
+  static constexpr int      option_slot_flags = 0x2;
+
+  static constexpr offset_type invalid_offset = ~offset_type{0};
+
+  static constexpr uint32_t control_headroom = 4 * cache_line_size;
+
+  // The read cursor is local to the consumer, and holds a snapshot of the write offset so that a
+  // batch of records can be read without touching the producer's state. The snapshot is only
+  // refreshed once the cursor catches up with it.
+  struct read_cursor {
+    offset_type offset{};
+    offset_type end_offset{};
+    offset_type start_offset{};
+  };
+
+  // The write cursor is local to the producer, records written through it are published together
+  // by end_write(). Dropping the cursor without calling end_write() discards them.
+  struct write_cursor {
+    offset_type offset{};
+    offset_type start_offset{};
+    offset_type read_offset{};
+
+    // With slot flags the id of the first record is held back until end_write().
+    offset_type pending_offset{};
+    uint32_t    pending_id{};
+  };
 
-  void                initialize(void* addr, size_t size);
+  // Mirrored channels must be initialized on a segment created with Segment::create_mirrored(),
+  // and use the first page for the channel state.
+  void                initialize(void* addr, size_t size, int options = 0, uint32_t record_alignment = cache_line_size);
+
+  bool                is_mirrored() const      { return m_mirrored; }
+  bool                is_slot_flags() const    { return m_slot_flags; }
+  uint32_t            record_alignment() const { return m_record_alignment; }
 
   auto&               consumer_state();
 
+  // The low-watermark of free space for writable notifications.
+  offset_type         write_threshold() const { return m_write_threshold; }
+
+  // Producer side, requests a writable notification. Returns false if the write threshold is
+  // already free, in which case no request is left pending.
+  bool                request_writable();
+  bool                is_writable_requested() const;
+
+  // Consumer side, returns true if the producer requested a writable notification and the write
+  // threshold is now free. The request is cleared, and the caller should wake the producer.
+  bool                release_writable();
+
   // There will always be at least one (unusable) cache line free, and headers are not included.
   //
   // Only use this for a rough estimate of available space.
-  uint32_t            available_write();
+  offset_type         available_write();
 
   bool                can_write(uint32_t size);
 
   bool                write(uint32_t id, uint32_t size, void* data);
 
+  // Reserve space for a record of up to 'max_size' bytes and return a pointer to its data, or
+  // nullptr if the channel is full. The record becomes visible to the reader on commit(), which
+  // may use a smaller size than reserved. Only one reservation may be active at a time.
+  void*               reserve(uint32_t id, uint32_t max_size);
+  void                commit(uint32_t size);
+  void                abort();
+
+  bool                is_reserved() const { return m_reserved; }
+
+  // Same as write() and reserve(), but may use the control headroom. The record must fit in the
+  // headroom to be guaranteed space.
+  bool                write_control(uint32_t id, uint32_t size, void* data);
+  void*               reserve_control(uint32_t id, uint32_t max_size);
+
+  write_cursor        begin_write();
+  bool                cursor_write(write_cursor& cursor, uint32_t id, uint32_t size, void* data);
+  void                end_write(write_cursor& cursor);
+
   header_type*        read_header();
   void                consume_header(header_type* header);
 
+  // Consumer side, a cheap check for spinning that does not validate the record.
+  bool                is_readable() const;
+
+  // Blocking wait for dedicated consumer threads that don't use Poll. Sleeps on a futex word in
+  // the channel until the producer calls notify_readable() or the timeout expires, and returns
+  // true if a record is readable. Use microseconds::max() to wait without a timeout.
+  //
+  // The producer must call notify_readable() after writing, which only does a syscall if the
+  // consumer is waiting. Platforms without futexes sleep in short intervals instead.
+  bool                wait_readable(std::chrono::microseconds timeout);
+  void                notify_readable();
+
+  // Batched reads use the cached write offset, and only publish the new read offset in
+  // end_read(). Records passed to cursor_consume() remain valid until end_read().
+  read_cursor         begin_read();
+  header_type*        cursor_read(read_cursor& cursor);
+  void                cursor_consume(read_cursor& cursor, header_type* header);
+  void                end_read(read_cursor& cursor);
+
 protected:
-  Channel() = delete;
-  ~Channel() = delete;
+  BasicChannel() = delete;
+  ~BasicChannel() = delete;
+
+  void*               reserve_record(uint32_t id, uint32_t max_size, offset_type headroom);
+
+  offset_type         find_write_offset(offset_type start_offset, offset_type end_offset, offset_type total_size);
+  offset_type         advance_offset(offset_type offset, offset_type total_size) const;
+
+  header_type*        header_at(offset_type offset) const;
+
+  // Header ids are accessed atomically when using slot flags.
+  static uint32_t     load_header_id(header_type* header);
+  static void         store_header_id(header_type* header, uint32_t id);
 
-  // Constant values, offset by sizeof(Channel).
+  void                publish_record(offset_type offset, uint32_t id, offset_type next_offset);
+
+  offset_type         align_record(offset_type size) const;
+  offset_type         used_size(offset_type start_offset, offset_type end_offset) const;
+  size_t              data_area_size() const;
+
+  // Constant values, offset by sizeof(BasicChannel).
 
   void*                 m_addr{};
-  uint32_t              m_size{};
-  uint32_t              m_write_threshold{};
+  offset_type           m_size{};
+  offset_type           m_write_threshold{};
+  uint32_t              m_record_alignment{cache_line_size};
+  bool                  m_mirrored{};
+  bool                  m_slot_flags{};
+
+  // Producer state, read by the consumer:
+
+  align_cacheline std::atomic<offset_type> m_write_offset{};
+
+  // Producer-only state:
+
+  align_cacheline offset_type m_cached_read_offset{};
 
-  // Mutable state:
+  bool                  m_reserved{};
+  offset_type           m_reserved_offset{};
+  uint32_t              m_reserved_size{};
+  uint32_t              m_reserved_id{};
 
-  std::atomic<uint32_t> m_read_offset{};
-  std::atomic<uint32_t> m_write_offset{};
+  // Consumer state, read by the producer:
+
+  align_cacheline std::atomic<offset_type> m_read_offset{};
 
   std::atomic<uint32_t> m_consumer_state{};
+  std::atomic<uint32_t> m_producer_state{};
+
+  // Futex word for wait_readable(), shared between processes.
+  std::atomic<uint32_t> m_read_wait_state{};
+
+  // Consumer-only state:
+
+  align_cacheline offset_type m_cached_write_offset{};
 };
 
-inline auto& Channel::consumer_state() { return m_consumer_state; }
+using Channel   = BasicChannel<uint32_t>;
+using Channel64 = BasicChannel<uint64_t>;
+
+extern template class BasicChannel<uint32_t>;
+extern template class BasicChannel<uint64_t>;
+
+template <typename Offset>
+inline auto& BasicChannel<Offset>::consumer_state() { return m_consumer_state; }
+
+template <typename Offset>
+inline bool
+BasicChannel<Offset>::is_writable_requested() const {
+  return m_producer_state.load(std::memory_order_acquire) & flag_write_waiting;
+}
+
+template <typename Offset>
+inline Offset
+BasicChannel<Offset>::align_record(offset_type size) const {
+  return (size + (m_record_alignment - 1)) & ~offset_type{m_record_alignment - 1};
+}
+
+template <typename Offset>
+inline Offset
+BasicChannel<Offset>::used_size(offset_type start_offset, offset_type end_offset) const {
+  return end_offset >= start_offset ? end_offset - start_offset : m_size - start_offset + end_offset;
+}
+
+template <typename Offset>
+inline typename BasicChannel<Offset>::header_type*
+BasicChannel<Offset>::header_at(offset_type offset) const {
+  return reinterpret_cast<header_type*>(static_cast<char*>(m_addr) + offset);
+}
+
+template <typename Offset>
+inline uint32_t
+BasicChannel<Offset>::load_header_id(header_type* header) {
+  return std::atomic_ref<uint32_t>(*reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(header) + sizeof(uint32_t))).load(std::memory_order_acquire);
+}
+
+template <typename Offset>
+inline void
+BasicChannel<Offset>::store_header_id(header_type* header, uint32_t id) {
+  std::atomic_ref<uint32_t>(*reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(header) + sizeof(uint32_t))).store(id, std::memory_order_release);
+}
+
+// The addressable size of the data area, including the mirror.
+template <typename Offset>
+inline size_t
+BasicChannel<Offset>::data_area_size() const {
+  return m_mirrored ? 2 * size_t{m_size} : size_t{m_size};
+}
 
 } // namespace torrent::shm
 
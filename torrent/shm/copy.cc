@@ -0,0 +1,166 @@
+#include "config.h"
+
+#include "torrent/shm/copy.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define USE_X86_STREAMING
+#include <immintrin.h>
+#endif
+
+namespace torrent::shm {
+
+namespace {
+
+using copy_func = void (*)(char* dest, const char* src, size_t size);
+
+struct copy_kernel {
+  copy_func   func;
+  const char* name;
+};
+
+std::atomic<size_t> g_streaming_threshold{default_streaming_threshold};
+
+void
+copy_scalar(char* dest, const char* src, size_t size) {
+  std::memcpy(dest, src, size);
+}
+
+#ifdef USE_X86_STREAMING
+
+// Each kernel copies an unaligned head with memcpy so the non-temporal stores are aligned, then
+// streams four vectors per iteration.
+
+[[gnu::target("sse2")]] void
+copy_stream_sse2(char* dest, const char* src, size_t size) {
+  size_t head = std::min<size_t>(-reinterpret_cast<uintptr_t>(dest) & 15, size);
+
+  std::memcpy(dest, src, head);
+  dest += head; src += head; size -= head;
+
+  for (; size >= 64; dest += 64, src += 64, size -= 64) {
+    __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+    __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+    __m128i v3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 48));
+
+    _mm_stream_si128(reinterpret_cast<__m128i*>(dest), v0);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(dest + 16), v1);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(dest + 32), v2);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(dest + 48), v3);
+  }
+
+  _mm_sfence();
+  std::memcpy(dest, src, size);
+}
+
+[[gnu::target("avx2")]] void
+copy_stream_avx2(char* dest, const char* src, size_t size) {
+  size_t head = std::min<size_t>(-reinterpret_cast<uintptr_t>(dest) & 31, size);
+
+  std::memcpy(dest, src, head);
+  dest += head; src += head; size -= head;
+
+  for (; size >= 128; dest += 128, src += 128, size -= 128) {
+    __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+    __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32));
+    __m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 64));
+    __m256i v3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 96));
+
+    _mm256_stream_si256(reinterpret_cast<__m256i*>(dest), v0);
+    _mm256_stream_si256(reinterpret_cast<__m256i*>(dest + 32), v1);
+    _mm256_stream_si256(reinterpret_cast<__m256i*>(dest + 64), v2);
+    _mm256_stream_si256(reinterpret_cast<__m256i*>(dest + 96), v3);
+  }
+
+  _mm_sfence();
+  _mm256_zeroupper();
+  std::memcpy(dest, src, size);
+}
+
+[[gnu::target("avx512f")]] void
+copy_stream_avx512(char* dest, const char* src, size_t size) {
+  size_t head = std::min<size_t>(-reinterpret_cast<uintptr_t>(dest) & 63, size);
+
+  std::memcpy(dest, src, head);
+  dest += head; src += head; size -= head;
+
+  for (; size >= 256; dest += 256, src += 256, size -= 256) {
+    __m512i v0 = _mm512_loadu_si512(src);
+    __m512i v1 = _mm512_loadu_si512(src + 64);
+    __m512i v2 = _mm512_loadu_si512(src + 128);
+    __m512i v3 = _mm512_loadu_si512(src + 192);
+
+    _mm512_stream_si512(reinterpret_cast<__m512i*>(dest), v0);
+    _mm512_stream_si512(reinterpret_cast<__m512i*>(dest + 64), v1);
+    _mm512_stream_si512(reinterpret_cast<__m512i*>(dest + 128), v2);
+    _mm512_stream_si512(reinterpret_cast<__m512i*>(dest + 192), v3);
+  }
+
+  _mm_sfence();
+  _mm256_zeroupper();
+  std::memcpy(dest, src, size);
+}
+
+#endif // USE_X86_STREAMING
+
+copy_kernel
+select_kernel() {
+#ifdef USE_X86_STREAMING
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f"))
+    return copy_kernel{copy_stream_avx512, "avx512"};
+
+  if (__builtin_cpu_supports("avx2"))
+    return copy_kernel{copy_stream_avx2, "avx2"};
+
+  if (__builtin_cpu_supports("sse2"))
+    return copy_kernel{copy_stream_sse2, "sse2"};
+#endif
+
+  return copy_kernel{copy_scalar, "scalar"};
+}
+
+const copy_kernel&
+streaming_kernel() {
+  static const copy_kernel kernel = select_kernel();
+
+  return kernel;
+}
+
+} // namespace
+
+void
+copy_payload(void* dest, const void* src, size_t size) {
+  if (size < g_streaming_threshold.load(std::memory_order_relaxed)) {
+    std::memcpy(dest, src, size);
+    return;
+  }
+
+  streaming_kernel().func(static_cast<char*>(dest), static_cast<const char*>(src), size);
+}
+
+void
+copy_streaming(void* dest, const void* src, size_t size) {
+  streaming_kernel().func(static_cast<char*>(dest), static_cast<const char*>(src), size);
+}
+
+size_t
+streaming_threshold() {
+  return g_streaming_threshold.load(std::memory_order_relaxed);
+}
+
+void
+set_streaming_threshold(size_t threshold) {
+  g_streaming_threshold.store(threshold, std::memory_order_relaxed);
+}
+
+const char*
+streaming_kernel_name() {
+  return streaming_kernel().name;
+}
+
+} // namespace torrent::shm
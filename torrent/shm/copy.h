@@ -0,0 +1,31 @@
+#ifndef LIBTORRENT_TORRENT_SHM_COPY_H
+#define LIBTORRENT_TORRENT_SHM_COPY_H
+
+#include <torrent/common.h>
+
+// Copy kernels for writing payloads into channels.
+//
+// Large payloads are only read by the other process, so copying them with regular stores evicts
+// the producer's working set from its cache. Payloads at or above the streaming threshold are
+// copied with non-temporal stores, using the widest vector instructions the CPU supports at
+// runtime. Smaller payloads use std::memcpy.
+//
+// The streaming kernels end with a store fence, so a following release store of the channel
+// offset publishes the payload as usual.
+
+namespace torrent::shm {
+
+constexpr size_t default_streaming_threshold = 256 * 1024;
+
+LIBTORRENT_EXPORT void        copy_payload(void* dest, const void* src, size_t size);
+LIBTORRENT_EXPORT void        copy_streaming(void* dest, const void* src, size_t size);
+
+LIBTORRENT_EXPORT size_t      streaming_threshold();
+LIBTORRENT_EXPORT void        set_streaming_threshold(size_t threshold);
+
+// Name of the streaming kernel selected for this CPU: avx512, avx2, sse2 or scalar.
+LIBTORRENT_EXPORT const char* streaming_kernel_name();
+
+} // namespace torrent::shm
+
+#endif // LIBTORRENT_TORRENT_SHM_COPY_H
@@ -0,0 +1,118 @@
+#include "config.h"
+
+#include "torrent/shm/doorbell.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "torrent/exceptions.h"
+
+namespace torrent::shm {
+
+void
+Doorbell::create_fds(int fds[2]) {
+#ifdef __linux__
+  int fd = ::eventfd(0, EFD_NONBLOCK);
+
+  if (fd == -1)
+    throw internal_error("Doorbell::create_fds(): eventfd() failed: " + std::string(std::strerror(errno)));
+
+  fds[0] = fd;
+  fds[1] = fd;
+#else
+  if (::pipe(fds) == -1)
+    throw internal_error("Doorbell::create_fds(): pipe() failed: " + std::string(std::strerror(errno)));
+
+  for (int i = 0; i < 2; i++) {
+    int flags = ::fcntl(fds[i], F_GETFL, 0);
+
+    if (flags == -1 || ::fcntl(fds[i], F_SETFL, flags | O_NONBLOCK) == -1)
+      throw internal_error("Doorbell::create_fds(): fcntl(O_NONBLOCK) failed: " + std::string(std::strerror(errno)));
+  }
+#endif
+}
+
+void
+Doorbell::open(int wait_fd, int ring_fd) {
+  set_file_descriptor(wait_fd);
+  m_ring_fd = ring_fd;
+}
+
+void
+Doorbell::close() {
+  if (!is_open())
+    return;
+
+  if (::close(file_descriptor()) == -1 || ::close(m_ring_fd) == -1)
+    throw internal_error("Doorbell::close() error closing doorbell fd: " + std::string(std::strerror(errno)));
+
+  set_file_descriptor(-1);
+  m_ring_fd = -1;
+}
+
+// A full pipe or eventfd counter means a wakeup is already pending, and a closed peer is detected
+// by the control fd.
+void
+Doorbell::ring() {
+  if (m_ring_fd == -1)
+    return;
+
+#ifdef __linux__
+  uint64_t value = 1;
+#else
+  char value = 0;
+#endif
+
+  while (::write(m_ring_fd, &value, sizeof(value)) == -1) {
+    if (errno == EINTR)
+      continue;
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EPIPE)
+      return;
+
+    throw internal_error("Doorbell::ring(): write failed: " + std::string(std::strerror(errno)));
+  }
+}
+
+// Only drains the doorbell, the channels are read by Router after polling.
+void
+Doorbell::event_read() {
+  char buffer[64];
+
+  while (true) {
+    auto result = ::read(file_descriptor(), buffer, sizeof(buffer));
+
+    if (result == -1 && errno == EINTR)
+      continue;
+
+    if (result == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+      throw internal_error("Doorbell::event_read(): read failed: " + std::string(std::strerror(errno)));
+
+#ifdef __linux__
+    // A single read resets the eventfd counter.
+    return;
+#else
+    if (result != sizeof(buffer))
+      return;
+#endif
+  }
+}
+
+void
+Doorbell::event_write() {
+  throw internal_error("Doorbell::event_write() should not be called on doorbell fd.");
+}
+
+void
+Doorbell::event_error() {
+  throw internal_error("Doorbell::event_error() error on doorbell fd: " + std::string(std::strerror(errno)));
+}
+
+} // namespace torrent::shm
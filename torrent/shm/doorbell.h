@@ -0,0 +1,41 @@
+#ifndef LIBTORRENT_TORRENT_SHM_DOORBELL_H
+#define LIBTORRENT_TORRENT_SHM_DOORBELL_H
+
+#include <torrent/event.h>
+
+// Wakes the other process from poll when a channel has new records, leaving the control socket
+// for control messages. A ring is a single write and a wakeup a single read, with no framing.
+//
+// Each process polls the read side of its own doorbell and rings the write side of the other
+// process' doorbell. On Linux a doorbell is an eventfd used for both sides, elsewhere a pipe. The
+// file descriptors are created before fork.
+
+namespace torrent::shm {
+
+class LIBTORRENT_EXPORT Doorbell : public Event {
+public:
+  Doorbell() = default;
+  ~Doorbell() = default;
+
+  // Sets fds[0] to the read side and fds[1] to the write side, which are the same file descriptor
+  // for an eventfd.
+  static void         create_fds(int fds[2]);
+
+  const char*         type_name() const override { return "ipc-doorbell"; }
+
+  void                open(int wait_fd, int ring_fd);
+  void                close();
+
+  void                ring();
+
+private:
+  void                event_read() override;
+  void                event_write() override;
+  void                event_error() override;
+
+  int                 m_ring_fd{-1};
+};
+
+} // namespace torrent::shm
+
+#endif // LIBTORRENT_TORRENT_SHM_DOORBELL_H
@@ -8,21 +8,18 @@
 
 #include "torrent/exceptions.h"
 #include "torrent/shm/channel.h"
+#include "torrent/shm/doorbell.h"
 #include "torrent/shm/router.h"
 #include "torrent/shm/segment.h"
 
 namespace torrent::shm {
 
 void
-RouterFactory::initialize(uint32_t segment_size) {
-  m_segment_1 = std::make_unique<Segment>();
-  m_segment_2 = std::make_unique<Segment>();
+RouterFactory::initialize(uint32_t segment_size, int channel_options, uint32_t record_alignment) {
+  m_channel_options  = channel_options;
+  m_record_alignment = record_alignment;
 
-  m_segment_1->create(segment_size);
-  m_segment_2->create(segment_size);
-
-  static_cast<torrent::shm::Channel*>(m_segment_1->address())->initialize(m_segment_1->address(), m_segment_1->size());
-  static_cast<torrent::shm::Channel*>(m_segment_2->address())->initialize(m_segment_2->address(), m_segment_2->size());
+  add_lane(segment_size);
 
   int socket_pair[2]{};
 
@@ -59,6 +56,39 @@ RouterFactory::initialize(uint32_t segment_size) {
 
   m_socket_1 = socket_pair[0];
   m_socket_2 = socket_pair[1];
+
+  Doorbell::create_fds(m_doorbell_1);
+  Doorbell::create_fds(m_doorbell_2);
+}
+
+void
+RouterFactory::add_lane(uint32_t segment_size) {
+  auto segment_1 = std::make_unique<Segment>();
+  auto segment_2 = std::make_unique<Segment>();
+
+  if (m_channel_options & Channel::option_mirrored) {
+    segment_1->create_mirrored(segment_size);
+    segment_2->create_mirrored(segment_size);
+  } else {
+    segment_1->create(segment_size);
+    segment_2->create(segment_size);
+  }
+
+  static_cast<torrent::shm::Channel*>(segment_1->address())->initialize(segment_1->address(), segment_1->size(), m_channel_options, m_record_alignment);
+  static_cast<torrent::shm::Channel*>(segment_2->address())->initialize(segment_2->address(), segment_2->size(), m_channel_options, m_record_alignment);
+
+  m_segments_1.push_back(std::move(segment_1));
+  m_segments_2.push_back(std::move(segment_2));
+}
+
+// Closes the doorbell fds only used by the other process, an eventfd is used by both.
+static void
+close_unused_doorbell_fds(int unused_wait_fd, int unused_ring_fd, int wait_fd, int ring_fd) {
+  if (unused_wait_fd != ring_fd)
+    ::close(unused_wait_fd);
+
+  if (unused_ring_fd != wait_fd)
+    ::close(unused_ring_fd);
 }
 
 // TODO: Use unique_ptr in Router, and let it steal our ptrs.
@@ -67,14 +97,18 @@ std::unique_ptr<Router>
 RouterFactory::create_parent_router() {
   ::close(m_socket_2);
 
-  return std::make_unique<Router>(m_socket_1, std::move(m_segment_1), std::move(m_segment_2));
+  close_unused_doorbell_fds(m_doorbell_2[0], m_doorbell_1[1], m_doorbell_1[0], m_doorbell_2[1]);
+
+  return std::make_unique<Router>(m_socket_1, m_doorbell_1[0], m_doorbell_2[1], std::move(m_segments_1), std::move(m_segments_2));
 }
 
 std::unique_ptr<Router>
 RouterFactory::create_child_router() {
   ::close(m_socket_1);
 
-  return std::make_unique<Router>(m_socket_2, std::move(m_segment_2), std::move(m_segment_1));
+  close_unused_doorbell_fds(m_doorbell_1[0], m_doorbell_2[1], m_doorbell_2[0], m_doorbell_1[1]);
+
+  return std::make_unique<Router>(m_socket_2, m_doorbell_2[0], m_doorbell_1[1], std::move(m_segments_2), std::move(m_segments_1));
 }
 
 } // namespace torrent::shm
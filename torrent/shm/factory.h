@@ -2,13 +2,14 @@
 #define LIBTORRENT_TORRENT_SHM_FACTORY_H
 
 #include <memory>
+#include <vector>
 #include <torrent/common.h>
+#include <torrent/shm/channel.h>
 
 // Holds the everything needed to create a Router.
 
 namespace torrent::shm {
 
-class Channel;
 class Router;
 class Segment;
 
@@ -17,18 +18,33 @@ public:
   RouterFactory() = default;
   ~RouterFactory() = default;
 
-  void                    initialize(uint32_t segment_size);
+  // Channel options select mirrored segments and the slot flags engine, and a record alignment
+  // smaller than the cache line packs small messages, see Channel.
+  void                    initialize(uint32_t segment_size, int channel_options = 0, uint32_t record_alignment = Channel::cache_line_size);
+
+  // Adds a lower priority lane with its own pair of segments, using the same channel options.
+  // Lane 0 is created by initialize().
+  void                    add_lane(uint32_t segment_size);
 
   std::unique_ptr<Router> create_parent_router();
   std::unique_ptr<Router> create_child_router();
 
 private:
+  using segment_list = std::vector<std::unique_ptr<Segment>>;
+
   int                      m_socket_1{};
   int                      m_socket_2{};
 
+  // Doorbell 1 wakes the parent and doorbell 2 the child.
+  int                      m_doorbell_1[2]{-1, -1};
+  int                      m_doorbell_2[2]{-1, -1};
+
+  int                      m_channel_options{};
+  uint32_t                 m_record_alignment{};
+
   // TODO: Copy move these to router.
-  std::unique_ptr<Segment> m_segment_1;
-  std::unique_ptr<Segment> m_segment_2;
+  segment_list             m_segments_1;
+  segment_list             m_segments_2;
 };
 
 } // namespace torrent::shm
@@ -2,7 +2,10 @@
 
 #include "torrent/shm/router.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <thread>
 #include <unistd.h>
 #include <sys/socket.h>
 
@@ -11,20 +14,36 @@
 #include "torrent/exceptions.h"
 #include "torrent/shm/channel.h"
 #include "torrent/shm/control_fd.h"
+#include "torrent/shm/doorbell.h"
 #include "torrent/shm/segment.h"
 #include "torrent/system/poll.h"
 
 namespace torrent::shm {
 
-Router::Router(int fd, std::unique_ptr<Segment> read_segment, std::unique_ptr<Segment> write_segment)
-  : m_read_segment(std::move(read_segment)),
-    m_write_segment(std::move(write_segment)) {
+Router::Router(int fd, int doorbell_wait_fd, int doorbell_ring_fd, segment_list read_segments, segment_list write_segments)
+  : m_read_segments(std::move(read_segments)),
+    m_write_segments(std::move(write_segments)) {
+
+  if (m_read_segments.empty() || m_read_segments.size() != m_write_segments.size())
+    throw torrent::internal_error("Router::Router(): read and write segments must be non-empty and of equal count");
+
+  if (m_read_segments.size() > max_lanes)
+    throw torrent::internal_error("Router::Router(): too many lanes");
 
   m_control_fd = std::make_unique<ControlFd>();
   m_control_fd->open(fd);
 
-  m_read_channel  = static_cast<Channel*>(m_read_segment->address());
-  m_write_channel = static_cast<Channel*>(m_write_segment->address());
+  m_doorbell = std::make_unique<Doorbell>();
+  m_doorbell->open(doorbell_wait_fd, doorbell_ring_fd);
+
+  for (auto& segment : m_read_segments)
+    m_read_channels.push_back(static_cast<Channel*>(segment->address()));
+
+  for (auto& segment : m_write_segments)
+    m_write_channels.push_back(static_cast<Channel*>(segment->address()));
+
+  m_control_queues.resize(m_write_channels.size());
+  m_reserved_channel = m_write_channels.front();
 }
 
 Router::~Router() = default;
@@ -34,10 +53,19 @@ Router::open_control_fd() {
   torrent::this_thread::poll()->open(m_control_fd.get());
   torrent::this_thread::poll()->insert_read(m_control_fd.get());
   torrent::this_thread::poll()->insert_error(m_control_fd.get());
+
+  torrent::this_thread::poll()->open(m_doorbell.get());
+  torrent::this_thread::poll()->insert_read(m_doorbell.get());
+  torrent::this_thread::poll()->insert_error(m_doorbell.get());
 }
 
 void
 Router::test_close_control_fd() {
+  if (m_doorbell->is_polling()) {
+    torrent::this_thread::poll()->remove_and_close(m_doorbell.get());
+    m_doorbell->close();
+  }
+
   if (!m_control_fd->is_polling())
     return;
 
@@ -52,84 +80,273 @@ Router::control_fd() {
 
 uint32_t
 Router::register_handler(data_func on_read, data_func on_error) {
-  auto id = m_next_id;
+  if (m_free_head == invalid_index)
+    add_slot_chunk();
 
-  while (!try_register_handler(id, on_read, on_error)) {
-    id++;
+  auto slot = slot_at(m_free_head);
+  auto id   = (slot->generation << id_index_bits) | m_free_head;
 
-    if (id == 0)
-      throw torrent::internal_error("Router::register_handler(): no available ids");
-  }
+  if (!try_register_handler(id, std::move(on_read), std::move(on_error)))
+    throw torrent::internal_error("Router::register_handler(): free slot already in use");
 
-  m_next_id = id + 1;
   return id;
 }
 
 void
 Router::register_handler(int id, data_func on_read, data_func on_error) {
-  if (!try_register_handler(id, on_read, on_error))
+  if (!try_register_handler(id, std::move(on_read), std::move(on_error)))
     throw torrent::internal_error("Router::register_handler(): id already in use");
 }
 
 bool
 Router::try_register_handler(int id, data_func on_read, data_func on_error) {
-  // TODO: Optimize to avoid double lookup.
-  auto itr = m_handlers.find(id);
-
-  if (itr != m_handlers.end())
-    return false;
+  if ((id & flag_mask) != 0 || (id & id_index_mask) == 0)
+    throw torrent::internal_error("Router::try_register_handler(): invalid id");
 
   if (!on_read)
     throw torrent::internal_error("Router::try_register_handler(): on_read handler is required");
   if (!on_error)
     throw torrent::internal_error("Router::try_register_handler(): on_error handler is required");
 
-  m_handlers[id] = RouterHandler{on_read, on_error};
+  auto handler = insert_handler(id);
+
+  if (handler == nullptr)
+    return false;
+
+  *handler = RouterHandler{std::move(on_read), std::move(on_error), nullptr, nullptr};
   return true;
 }
 
+void
+Router::set_batch_handler(uint32_t id, batch_func on_read_batch) {
+  auto handler = find_handler(id);
+
+  if (handler == nullptr)
+    throw torrent::internal_error("Router::set_batch_handler(): id not found");
+
+  handler->on_read_batch = on_read_batch;
+}
+
+void
+Router::set_lane(uint32_t id, uint32_t lane) {
+  auto handler = find_handler(id);
+
+  if (handler == nullptr)
+    throw torrent::internal_error("Router::set_lane(): id not found");
+
+  if (lane >= m_write_channels.size())
+    throw torrent::internal_error("Router::set_lane(): invalid lane");
+
+  handler->lane = lane;
+}
+
+void
+Router::set_writable_handler(writable_func on_writable) {
+  m_on_writable = on_writable;
+}
+
+void
+Router::set_writable_handler(uint32_t id, writable_func on_writable) {
+  auto handler = find_handler(id);
+
+  if (handler == nullptr)
+    throw torrent::internal_error("Router::set_writable_handler(): id not found");
+
+  handler->on_writable = on_writable;
+}
+
+void
+Router::request_writable() {
+  if (!m_on_writable)
+    throw torrent::internal_error("Router::request_writable(): no writable handler");
+
+  m_writable_requested = true;
+
+  for (uint32_t lane = 0; lane != m_write_channels.size(); lane++)
+    arm_writable(lane);
+}
+
+void
+Router::request_writable(uint32_t id) {
+  auto handler = find_handler(id);
+
+  if (handler == nullptr || !handler->on_writable)
+    throw torrent::internal_error("Router::request_writable(): id not found or no writable handler");
+
+  if (std::find(m_writable_ids.begin(), m_writable_ids.end(), id) == m_writable_ids.end())
+    m_writable_ids.push_back(id);
+
+  arm_writable(handler->lane);
+}
+
 void
 Router::close(uint32_t id) {
-  auto itr = m_handlers.find(id);
+  auto handler = find_handler(id);
 
-  if (itr == m_handlers.end())
+  if (handler == nullptr)
     throw torrent::internal_error("Router::close(): id not found");
 
-  if (itr->second.is_closed_write())
+  if (handler->is_closed_write())
     throw torrent::internal_error("Router::close(): handler already closed for write");
 
-  // TODO: This should check we've had the close acknowledged back from the other side.
-  // TODO: However if we're doing ping-pong close messages then unregister_handler() isn't really needed.
+  auto lane = handler->lane;
 
-  if (itr->second.is_closed_read()) {
-    m_handlers.erase(itr);
-    return;
+  if (handler->is_closed_read()) {
+    erase_handler(id);
+  } else {
+    handler->on_error = nullptr;
   }
 
-  itr->second.on_error = nullptr;
-
-  if (!m_write_channel->write(id | Router::flag_close, 0, nullptr)) {
-    // TODO: Add to a pending close queue to retry later?
-    throw torrent::internal_error("Router::close(): failed to write close event to channel");
-  }
+  queue_control(lane, id | Router::flag_close);
+  flush_control();
 }
 
 bool
 Router::write(uint32_t id, uint32_t size, void* data) {
-  assert(m_handlers.find(id) != m_handlers.end());
+  assert(id < static_id_limit || find_handler(id) != nullptr);
+
+  if (m_batching)
+    throw torrent::internal_error("Router::write(): called while batching writes");
 
   // if (size == 0)
   //   return true;
 
-  if (!m_write_channel->write(id, size, data))
+  if (!acquire_credit(id, size))
     return false;
 
-  if (m_write_channel->consumer_state().load(std::memory_order_acquire) & Channel::flag_polling)
-    m_control_fd->send_interrupt();
+  if (!write_channel(id)->write(id, size, data)) {
+    refund_credit(id, size);
+    return false;
+  }
 
+  interrupt_if_polling();
   return true;
 }
 
+void*
+Router::reserve(uint32_t id, uint32_t max_size) {
+  assert(id < static_id_limit || find_handler(id) != nullptr);
+
+  if (m_batching)
+    throw torrent::internal_error("Router::reserve(): called while batching writes");
+
+  if (!acquire_credit(id, max_size))
+    return nullptr;
+
+  auto channel = write_channel(id);
+  auto data    = channel->reserve(id, max_size);
+
+  if (data == nullptr) {
+    refund_credit(id, max_size);
+    return nullptr;
+  }
+
+  m_reserved_channel = channel;
+  m_reserved_id      = id;
+  m_reserved_size    = max_size;
+
+  return data;
+}
+
+void
+Router::commit(uint32_t size) {
+  m_reserved_channel->commit(size);
+
+  refund_credit(m_reserved_id, m_reserved_size - size);
+
+  flush_control();
+  interrupt_if_polling();
+}
+
+void
+Router::abort() {
+  m_reserved_channel->abort();
+
+  refund_credit(m_reserved_id, m_reserved_size);
+
+  flush_control();
+}
+
+void
+Router::begin_batch(uint32_t lane) {
+  if (m_batching)
+    throw torrent::internal_error("Router::begin_batch(): already batching writes");
+
+  if (lane >= m_write_channels.size())
+    throw torrent::internal_error("Router::begin_batch(): invalid lane");
+
+  m_batch_lane   = lane;
+  m_batch_cursor = m_write_channels[lane]->begin_write();
+  m_batch_count  = 0;
+  m_batching     = true;
+
+  m_batch_credits.clear();
+}
+
+bool
+Router::batch_write(uint32_t id, uint32_t size, void* data) {
+  assert(id < static_id_limit || find_handler(id) != nullptr);
+
+  if (!m_batching)
+    throw torrent::internal_error("Router::batch_write(): not batching writes");
+
+  if (write_lane(id) != m_batch_lane)
+    throw torrent::internal_error("Router::batch_write(): id is not on the batch lane");
+
+  if (!acquire_credit(id, size))
+    return false;
+
+  if (!m_write_channels[m_batch_lane]->cursor_write(m_batch_cursor, id, size, data)) {
+    refund_credit(id, size);
+    return false;
+  }
+
+  if (size != 0 && id >= static_id_limit) {
+    auto handler = find_handler(id);
+
+    if (handler != nullptr && handler->credit_window != 0)
+      m_batch_credits.emplace_back(id, size);
+  }
+
+  m_batch_count++;
+  return true;
+}
+
+uint32_t
+Router::commit_batch() {
+  if (!m_batching)
+    throw torrent::internal_error("Router::commit_batch(): not batching writes");
+
+  m_batching = false;
+
+  if (m_batch_count == 0) {
+    flush_control();
+    return 0;
+  }
+
+  m_write_channels[m_batch_lane]->end_write(m_batch_cursor);
+  flush_control();
+
+  interrupt_if_polling();
+  return m_batch_count;
+}
+
+void
+Router::abort_batch() {
+  if (!m_batching)
+    throw torrent::internal_error("Router::abort_batch(): not batching writes");
+
+  m_batching    = false;
+  m_batch_count = 0;
+
+  for (auto [id, size] : m_batch_credits)
+    refund_credit(id, size);
+
+  m_batch_credits.clear();
+
+  flush_control();
+}
+
 void
 Router::send_graceful_shutdown() {
   m_control_fd->send_graceful_shutdown();
@@ -161,75 +378,717 @@ Router::send_fatal_error(const char* msg, uint32_t size) {
   m_control_fd->close();
 }
 
-// TODO: This should be a static function that takes a vector of routers to process.
+// Use RouterGroup to process multiple routers with a single poll call.
 
-void
+bool
 Router::process_reads_pre_polling() {
-  process_reads();
-  m_read_channel->consumer_state().store(Channel::flag_polling, std::memory_order_release);
-  process_reads();
+  auto usage = start_read_usage(m_read_budget);
+
+  if (process_reads(m_read_budget, usage))
+    return true;
+
+  if (m_spinner.is_enabled() && m_spinner.spin([this]() { return is_readable(); })) {
+    process_reads(m_read_budget, usage);
+    return true;
+  }
+
+  set_polling_flag();
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  signal_writable();
+  process_writable();
+
+  if (process_reads(m_read_budget, usage)) {
+    clear_polling_flag();
+    return true;
+  }
+
+  return false;
 }
 
-void
+bool
 Router::process_reads_post_polling() {
-  m_read_channel->consumer_state().store(0, std::memory_order_release);
-  process_reads();
+  auto usage = start_read_usage(m_read_budget);
+
+  clear_polling_flag();
+  process_writable();
+
+  return process_reads(m_read_budget, usage);
+}
+
+bool
+Router::is_readable() const {
+  return std::any_of(m_read_channels.begin(), m_read_channels.end(), [](auto channel) { return channel->is_readable(); });
 }
 
+// Only the urgent lane holds the polling flag, the reads done after setting it check all lanes.
 void
-Router::process_reads() {
-  // TODO: Limit number of reads per call to avoid starvation of other tasks. (based on length, not messages?)
+Router::set_polling_flag() {
+  m_read_channels.front()->consumer_state().store(Channel::flag_polling, std::memory_order_release);
+}
 
-  while (true) {
-    auto header = m_read_channel->read_header();
+void
+Router::clear_polling_flag() {
+  m_read_channels.front()->consumer_state().store(0, std::memory_order_release);
+}
+
+bool
+Router::has_pending_control() const {
+  return std::any_of(m_control_queues.begin(), m_control_queues.end(), [](auto& queue) { return !queue.empty(); });
+}
+
+void
+Router::queue_control(uint32_t lane, uint32_t entry) {
+  m_control_queues[lane].push_back(entry);
+}
+
+// Writes queued control entries packed into records that fit the control headroom. If the channel
+// is full the entries stay queued, and a writable notification makes sure the flush is retried.
+void
+Router::flush_control() {
+  size_t total_written = 0;
+
+  for (uint32_t lane = 0; lane != m_control_queues.size(); lane++) {
+    auto& queue   = m_control_queues[lane];
+    auto  channel = m_write_channels[lane];
+
+    if (queue.empty() || (m_batching && lane == m_batch_lane) || channel->is_reserved())
+      continue;
 
-    if (header == nullptr)
+    size_t written = 0;
+
+    while (written != queue.size()) {
+      size_t count = 0;
+
+      // Keep credit entries together with their size.
+      while (written + count != queue.size()) {
+        size_t entry_count = (queue[written + count] & flag_mask) == flag_credit ? 2 : 1;
+
+        if (count + entry_count > control_max_entries)
+          break;
+
+        count += entry_count;
+      }
+
+      if (!channel->write_control(control_record_id, count * sizeof(uint32_t), queue.data() + written))
+        break;
+
+      written += count;
+    }
+
+    queue.erase(queue.begin(), queue.begin() + written);
+
+    if (!queue.empty())
+      arm_writable(lane);
+
+    total_written += written;
+  }
+
+  if (total_written != 0)
+    interrupt_if_polling();
+}
+
+void
+Router::process_control(Channel::header_type* header) {
+  if (header->size % sizeof(uint32_t) != 0)
+    throw torrent::internal_error("Router::process_control(): invalid control record size");
+
+  for (uint32_t offset = 0; offset != header->size; offset += sizeof(uint32_t)) {
+    uint32_t entry;
+    std::memcpy(&entry, header->data + offset, sizeof(entry));
+
+    switch (entry & flag_mask) {
+    case flag_close:
+      process_close(entry & ~flag_mask);
       break;
 
-    // TODO: Add a special handler for id=0?
+    case flag_credit: {
+      uint32_t size;
+
+      offset += sizeof(uint32_t);
 
-    auto itr = m_handlers.find(header->id & ~Router::flag_mask);
+      if (offset == header->size)
+        throw torrent::internal_error("Router::process_control(): credit entry without size");
 
-    if (itr == m_handlers.end()) {
-      // This really shouldn't happen.
-      throw torrent::internal_error("Router::process_reads(): received data for unknown handler id");
+      std::memcpy(&size, header->data + offset, sizeof(size));
 
-      // m_read_channel->consume_header(header);
-      // continue;
+      release_credit(entry & ~flag_mask, size);
+      break;
+    }
+
+    default:
+      throw torrent::internal_error("Router::process_control(): unknown control entry");
     }
+  }
+}
+
+void
+Router::set_credit_window(uint32_t id, uint32_t window) {
+  auto handler = find_handler(id);
+
+  if (handler == nullptr)
+    throw torrent::internal_error("Router::set_credit_window(): id not found");
+
+  handler->credit_window = window;
+}
+
+uint32_t
+Router::available_credit(uint32_t id) {
+  auto handler = find_handler(id);
+
+  if (handler == nullptr)
+    throw torrent::internal_error("Router::available_credit(): id not found");
+
+  if (handler->credit_window == 0)
+    return ~uint32_t{};
+
+  return handler->credit_window - std::min(handler->credit_used, handler->credit_window);
+}
+
+// Writer side, returns false and marks the handler as blocked if the write would exceed the
+// window. A write larger than the window could never be sent, as no returned credits would wake
+// the handler.
+bool
+Router::acquire_credit(uint32_t id, uint32_t size) {
+  if (id < static_id_limit || size == 0)
+    return true;
 
-    if (header->size != 0 && !itr->second.is_closed_read())
-      itr->second.on_read(header->data, header->size);
+  auto handler = find_handler(id);
 
-    // TODO: Error on size == 0 and not close?
+  if (handler == nullptr || handler->credit_window == 0)
+    return true;
 
-    if (header->id & Router::flag_close) {
-      if (itr->second.is_closed_read()) {
-        m_handlers.erase(itr);
+  if (size > handler->credit_window)
+    throw torrent::internal_error("Router::acquire_credit(): write is larger than the credit window");
 
-        m_read_channel->consume_header(header);
+  if (size > handler->credit_window - std::min(handler->credit_used, handler->credit_window)) {
+    handler->credit_blocked = true;
+    return false;
+  }
+
+  handler->credit_used += size;
+  return true;
+}
+
+// Writer side, gives back credits of a write that failed or used less than reserved. The id is
+// still blocked until the reader returns credits, as the channel may be full.
+void
+Router::refund_credit(uint32_t id, uint32_t size) {
+  if (id < static_id_limit || size == 0)
+    return;
+
+  auto handler = find_handler(id);
+
+  if (handler == nullptr || handler->credit_window == 0)
+    return;
+
+  handler->credit_used -= std::min(handler->credit_used, size);
+}
+
+// Credits returned by the reader. The writable handler of a blocked id is called after the read
+// pass, so it doesn't write from within process_control().
+void
+Router::release_credit(uint32_t id, uint32_t size) {
+  if (id < static_id_limit || size == 0)
+    return;
+
+  auto handler = find_handler(id);
+
+  if (handler == nullptr || handler->credit_window == 0)
+    return;
+
+  handler->credit_used -= std::min(handler->credit_used, size);
+
+  if (handler->credit_blocked)
+    m_credit_writable_ids.push_back(id);
+}
+
+void
+Router::process_credit_writable() {
+  m_credit_writable_processing.clear();
+  m_credit_writable_processing.swap(m_credit_writable_ids);
+
+  for (auto id : m_credit_writable_processing) {
+    auto handler = find_handler(id);
+
+    // Skips duplicates and ids closed during the read pass.
+    if (handler == nullptr || !handler->credit_blocked)
+      continue;
+
+    handler->credit_blocked = false;
+
+    if (handler->on_writable)
+      handler->on_writable();
+  }
+}
+
+// Reader side, counts consumed bytes to be returned after the read pass.
+void
+Router::consume_credit(uint32_t id, RouterHandler* handler, uint32_t size) {
+  if (handler->credit_window == 0 || size == 0)
+    return;
+
+  if (handler->credit_consumed == 0)
+    m_credit_ids.push_back(id);
+
+  handler->credit_consumed += size;
+}
+
+void
+Router::return_credits() {
+  for (auto id : m_credit_ids) {
+    auto handler = find_handler(id);
+
+    if (handler == nullptr || handler->credit_consumed == 0)
+      continue;
+
+    // Credits may be returned ahead of the id's messages, so they use the urgent lane.
+    queue_control(0, id | flag_credit);
+    queue_control(0, handler->credit_consumed);
+
+    handler->credit_consumed = 0;
+  }
+
+  m_credit_ids.clear();
+}
+
+// The handler is erased once both sides have closed, on_read set to nullptr marks the other side
+// as closed.
+//
+// With a handler factory the other side may close an id this side has not seen, if it never wrote
+// to it or its writes failed. The handler is then created so that this side's close lets the
+// other side erase the id.
+void
+Router::process_close(uint32_t id) {
+  auto handler = find_handler(id);
+
+  if (handler == nullptr) {
+    if (!m_handler_factory || id < static_id_limit)
+      throw torrent::internal_error("Router::process_close(): received close for unknown handler id");
+
+    handler = create_handler(id);
+  }
+
+  if (handler->is_closed_write()) {
+    erase_handler(id);
+    return;
+  }
+
+  handler->on_read = nullptr;
+}
+
+// Consumer side, wakes the other side if it requested a writable notification and enough of the
+// read channel is now free.
+void
+Router::signal_writable() {
+  bool released = false;
+
+  for (auto channel : m_read_channels)
+    released |= channel->release_writable();
+
+  if (released)
+    interrupt_if_polling();
+}
+
+// Producer side, calls the writable handlers once the other side has cleared the request.
+//
+// The router-wide handler is called once a lane that was full has drained, or if no lane was full
+// when requested.
+void
+Router::process_writable() {
+  uint32_t drained_lanes = 0;
+
+  for (uint32_t lane = 0; lane != m_write_channels.size(); lane++) {
+    if ((m_writable_lanes & (1 << lane)) && !m_write_channels[lane]->is_writable_requested())
+      drained_lanes |= 1 << lane;
+  }
+
+  uint32_t cleared_lanes = drained_lanes | m_writable_ready_lanes;
+
+  if (cleared_lanes == 0)
+    return;
+
+  m_writable_lanes       &= ~drained_lanes;
+  m_writable_ready_lanes  = 0;
+
+  if (m_writable_requested && (drained_lanes != 0 || m_writable_lanes == 0)) {
+    m_writable_requested = false;
+    m_on_writable();
+  }
+
+  // Handlers may request writable again, so swap out the list before calling them. Ids on lanes
+  // that are still full stay queued.
+  m_writable_ids_processing.clear();
+  m_writable_ids_processing.swap(m_writable_ids);
+
+  for (auto id : m_writable_ids_processing) {
+    auto handler = find_handler(id);
+
+    if (handler == nullptr || !handler->on_writable)
+      continue;
+
+    if (!(cleared_lanes & (1 << handler->lane))) {
+      if (std::find(m_writable_ids.begin(), m_writable_ids.end(), id) == m_writable_ids.end())
+        m_writable_ids.push_back(id);
+
+      continue;
+    }
+
+    handler->on_writable();
+  }
+}
+
+// Lanes that already have the threshold free are not armed, and their handlers are called on the
+// next process_reads_*().
+void
+Router::arm_writable(uint32_t lane) {
+  if (m_writable_lanes & (1 << lane))
+    return;
+
+  if (!m_write_channels[lane]->request_writable()) {
+    m_writable_ready_lanes |= 1 << lane;
+    return;
+  }
+
+  m_writable_lanes |= 1 << lane;
+}
+
+// Producer side, rings the doorbell at most once per poll cycle of the other side, which clears
+// flag_wakeup_pending when it sets or clears flag_polling.
+//
+// The fence orders the records and flags written before the call with the load of the polling
+// flag, and pairs with the fence after set_polling_flag().
+void
+Router::interrupt_if_polling() {
+  auto& state = m_write_channels.front()->consumer_state();
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if ((state.load(std::memory_order_relaxed) & (Channel::flag_polling | Channel::flag_wakeup_pending)) != Channel::flag_polling)
+    return;
+
+  auto previous = state.fetch_or(Channel::flag_wakeup_pending, std::memory_order_relaxed);
+
+  if ((previous & (Channel::flag_polling | Channel::flag_wakeup_pending)) != Channel::flag_polling)
+    return;
+
+  m_doorbell->ring();
+}
+
+Router::read_usage
+Router::start_read_usage(const RouterReadBudget& budget) {
+  read_usage usage;
+
+  if (budget.max_time != std::chrono::microseconds::max())
+    usage.deadline = std::chrono::steady_clock::now() + budget.max_time;
+  else
+    usage.deadline = std::chrono::steady_clock::time_point::max();
+
+  return usage;
+}
+
+bool
+Router::is_read_budget_exhausted(const RouterReadBudget& budget, const read_usage& usage) {
+  if (usage.messages == 0)
+    return false;
+
+  if (usage.messages >= budget.max_messages || usage.bytes >= budget.max_bytes)
+    return true;
+
+  if (usage.messages % RouterReadBudget::time_check_interval != 0 || usage.deadline == std::chrono::steady_clock::time_point::max())
+    return false;
+
+  return std::chrono::steady_clock::now() >= usage.deadline;
+}
+
+// Returns true if the budget ran out while messages remain.
+//
+// Messages are handled in channel order, so a flood on one id can't be skipped over without
+// copying. Fairness between ids is instead bounded by the budget, which returns control to the
+// event loop.
+//
+// The urgent lane is drained first, and the other lanes are read in priority order one slice at a
+// time, going back to the urgent lane after each full slice.
+bool
+Router::process_reads(const RouterReadBudget& budget, read_usage& usage) {
+  uint32_t lane = 0;
+
+  while (lane != m_read_channels.size() && !usage.exhausted) {
+    auto message_limit = lane == 0 ? ~uint32_t{} : lane_slice_messages;
+
+    if (process_lane(m_read_channels[lane], budget, usage, message_limit) && lane != 0) {
+      lane = 0;
+      continue;
+    }
+
+    lane++;
+  }
+
+  signal_writable();
+
+  return_credits();
+  flush_control();
+
+  process_credit_writable();
+
+  return usage.exhausted;
+}
+
+// Returns true if the message limit was reached.
+bool
+Router::process_lane(Channel* channel, const RouterReadBudget& budget, read_usage& usage, uint32_t message_limit) {
+  // Consumed records are published in one store when the batch ends, including when a handler
+  // throws.
+  auto cursor         = channel->begin_read();
+  auto first_messages = usage.messages;
+  bool limit_reached  = false;
+
+  try {
+    while (true) {
+      if (usage.messages - first_messages >= message_limit) {
+        limit_reached = true;
+        break;
+      }
+
+      auto header = channel->cursor_read(cursor);
+
+      if (header == nullptr)
+        break;
+
+      if (is_read_budget_exhausted(budget, usage)) {
+        usage.exhausted = true;
+        break;
+      }
+
+      usage.bytes += header->size;
+      usage.messages++;
+
+      // Consumed before processing so that a bad entry doesn't throw again on every read pass. The
+      // record stays valid until end_read().
+      if (header->id == control_record_id) {
+        channel->cursor_consume(cursor, header);
+
+        process_control(header);
         continue;
       }
 
-      if (header->size != 0)
-        throw torrent::internal_error("Router::process_reads(): close message with non-zero size");
+      auto id = header->id & ~Router::flag_mask;
 
-      itr->second.on_read = nullptr;
+      if (id < static_id_limit && m_static_dispatch != nullptr && !(header->id & Router::flag_close) &&
+          m_static_dispatch(m_static_object, id, header->data, header->size)) {
+        channel->cursor_consume(cursor, header);
+        continue;
+      }
 
-      m_read_channel->consume_header(header);
-      continue;
+      auto handler = find_handler(id);
+
+      if (handler == nullptr)
+        handler = create_handler(id);
+
+      if (handler->on_read_batch && header->size != 0 && !handler->is_closed_read() && !(header->id & Router::flag_close)) {
+        process_batch(channel, handler, cursor, header, budget, usage, message_limit - (usage.messages - first_messages - 1));
+        continue;
+      }
+
+      if (header->size != 0 && !handler->is_closed_read()) {
+        handler->on_read(header->data, header->size);
+        consume_credit(id, handler, header->size);
+      }
+
+      // TODO: Error on size == 0 and not close?
+
+      if (header->id & Router::flag_close) {
+        if (header->size != 0)
+          throw torrent::internal_error("Router::process_reads(): close message with non-zero size");
+
+        process_close(id);
+      }
+
+      channel->cursor_consume(cursor, header);
     }
 
-    m_read_channel->consume_header(header);
+  } catch (...) {
+    channel->end_read(cursor);
+    throw;
+  }
+
+  channel->end_read(cursor);
+  return limit_reached;
+}
+
+// Collects the messages following header with the same id, and consumes them after the handler
+// returns. The channel records are not released until end_read(), so the batch can point into the
+// channel.
+//
+// The batch holds at most message_limit messages, including header, so a bulk id can't hold up
+// the urgent lane beyond the lane's slice.
+void
+Router::process_batch(Channel* channel, RouterHandler* handler, Channel::read_cursor& cursor, Channel::header_type* header,
+                      const RouterReadBudget& budget, read_usage& usage, uint32_t message_limit) {
+  auto batch_cursor = cursor;
+  auto batch_id     = header->id;
+
+  m_read_batch.clear();
+
+  while (true) {
+    m_read_batch.push_back(RouterMessage{header->data, header->size});
+    channel->cursor_consume(batch_cursor, header);
+
+    if (m_read_batch.size() >= message_limit)
+      break;
+
+    header = channel->cursor_read(batch_cursor);
+
+    if (header == nullptr || header->id != batch_id || header->size == 0)
+      break;
+
+    if (is_read_budget_exhausted(budget, usage))
+      break;
+
+    usage.bytes += header->size;
+    usage.messages++;
+  }
+
+  handler->on_read_batch(std::span<const RouterMessage>(m_read_batch));
+
+  for (auto& message : m_read_batch)
+    consume_credit(batch_id & ~flag_mask, handler, message.size);
+
+  cursor = batch_cursor;
+}
+
+void
+RouterSpinner::set_policy(const RouterSpinPolicy& policy) {
+  if (policy.max_time != std::chrono::nanoseconds::zero() && policy.min_time > policy.max_time)
+    throw torrent::internal_error("RouterSpinner::set_policy(): min_time is larger than max_time");
+
+  m_enabled          = policy.max_time != std::chrono::nanoseconds::zero() && std::thread::hardware_concurrency() > 1;
+  m_policy           = policy;
+  m_stats.spin_limit = policy.max_time;
+}
+
+void
+RouterSpinner::reset_stats() {
+  m_stats = RouterSpinStats{0, 0, {}, m_policy.max_time};
+}
+
+void
+RouterSpinner::update(bool hit, std::chrono::nanoseconds waited) {
+  m_stats.spin_time += waited;
+
+  if (hit) {
+    m_stats.hits++;
+    m_stats.spin_limit += (2 * waited - m_stats.spin_limit) / 4;
+  } else {
+    m_stats.misses++;
+    m_stats.spin_limit /= 2;
   }
 
-  // TODO: Replace zero-length close messages with a id=0 special message that is buffered and
-  // packed.
-  //
-  // By adding a (free space) buffer for special messages we avoid writes of closes failing.
-  //
-  // The process_reads() function can then send these special messages after reading normal
-  // messages, and do reads while the buffer is insufficient to send them.
+  m_stats.spin_limit = std::clamp(m_stats.spin_limit, m_policy.min_time, m_policy.max_time);
+}
+
+// Claims the slot for the id, returns nullptr if it is in use. Slots beyond the table are
+// allocated in whole chunks, with the unused slots added to the free list.
+RouterHandler*
+Router::insert_handler(uint32_t id) {
+  auto index = id & id_index_mask;
+
+  while (index >= m_slot_count)
+    add_slot_chunk();
+
+  auto slot = slot_at(index);
+
+  if (!slot->is_free())
+    return nullptr;
+
+  if (index >= static_id_limit)
+    unlink_free_slot(index);
+
+  slot->id         = id;
+  slot->generation = id >> id_index_bits;
+
+  return &slot->handler;
+}
+
+// Lets the handler factory register a handler for an id opened by the other side.
+RouterHandler*
+Router::create_handler(uint32_t id) {
+  if (!m_handler_factory || id < static_id_limit) {
+    // This really shouldn't happen.
+    throw torrent::internal_error("Router::process_reads(): received data for unknown handler id");
+  }
+
+  m_handler_factory(id);
+
+  auto handler = find_handler(id);
+
+  if (handler == nullptr)
+    throw torrent::internal_error("Router::create_handler(): handler factory did not register the id");
+
+  return handler;
+}
+
+void
+Router::erase_handler(uint32_t id) {
+  auto index = id & id_index_mask;
+  auto slot  = slot_at(index);
+
+  if (slot->id != id)
+    throw torrent::internal_error("Router::erase_handler(): id not found");
+
+  slot->handler    = RouterHandler{};
+  slot->id         = 0;
+  slot->generation = (slot->generation + 1) & id_generation_limit;
+
+  if (index >= static_id_limit)
+    push_free_slot(index);
+}
+
+void
+Router::add_slot_chunk() {
+  if (m_slot_count > id_index_mask)
+    throw torrent::internal_error("Router::add_slot_chunk(): no available ids");
+
+  auto first_index = m_slot_count;
+
+  m_slot_chunks.push_back(std::make_unique<RouterHandlerSlot[]>(slot_chunk_size));
+  m_slot_count += slot_chunk_size;
+
+  // Push in reverse so that lower indices are allocated first. Slots below static_id_limit are
+  // only claimed by explicit ids, and index 0 is set to an id that never matches a lookup.
+  auto first_free = std::max(first_index, static_id_limit);
+
+  for (auto index = m_slot_count; index != first_free; index--)
+    push_free_slot(index - 1);
+
+  if (first_index == 0)
+    slot_at(0)->id = invalid_index;
+}
+
+void
+Router::push_free_slot(uint32_t index) {
+  auto slot = slot_at(index);
+
+  slot->prev_free = invalid_index;
+  slot->next_free = m_free_head;
+
+  if (m_free_head != invalid_index)
+    slot_at(m_free_head)->prev_free = index;
+
+  m_free_head = index;
+}
+
+void
+Router::unlink_free_slot(uint32_t index) {
+  auto slot = slot_at(index);
+
+  if (slot->prev_free != invalid_index)
+    slot_at(slot->prev_free)->next_free = slot->next_free;
+  else
+    m_free_head = slot->next_free;
+
+  if (slot->next_free != invalid_index)
+    slot_at(slot->next_free)->prev_free = slot->prev_free;
 }
 
 } // namespace torrent::shm
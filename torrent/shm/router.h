@@ -1,9 +1,13 @@
 #ifndef LIBTORRENT_TORRENT_SHM_ROUTER_H
 #define LIBTORRENT_TORRENT_SHM_ROUTER_H
 
-#include <map>
+#include <algorithm>
 #include <memory>
+#include <span>
+#include <type_traits>
+#include <vector>
 #include <torrent/common.h>
+#include <torrent/shm/channel.h>
 
 // Uses read and write shm::Channel for inter-process communication.
 //
@@ -13,22 +17,159 @@
 // Channel::header_type is passed to the reader to efficiently read data, and the reader tells
 // Router when it is consumed.
 //
-// We store id's with std::function handlers, and for now just use a simple container for that.
+// Handlers are stored in a flat slot table indexed by the low bits of the id, and the bits below
+// the flags hold a generation tag that is bumped when a slot is freed. Stale ids thus never match
+// a reused slot. Free slots are kept in a doubly linked list so ids chosen by the other side can
+// be claimed in constant time.
 //
-// We may later want to optimize this with a more efficient container. So add member functions for access.
+// The table grows in fixed size chunks so handlers never move, which allows handlers to register
+// new ids while being called.
 //
 // Router should have one channel producer, and one consumer, to avoid id conflicts.
+//
+// A Router may have several channels per direction, called lanes, with lane 0 being the urgent
+// lane. Each id writes to a single lane so messages for an id stay ordered, and reads always drain
+// the urgent lane before taking a slice of the lower priority lanes. All lanes share the control
+// fd, and the other side only checks the polling flag of lane 0.
 
 namespace torrent::shm {
 
 // Add to common.h
-class Channel;
 class ControlFd;
+class Doorbell;
 class PublicControlFd;
+class RouterGroup;
 class Segment;
 
+// An object pointer and a function that calls a member function on it. Binding does not allocate,
+// and calls are a single indirect call.
+template <typename... Args>
+class BasicRouterCallback {
+public:
+  using func_type = void (*)(void* object, Args... args);
+
+  BasicRouterCallback() = default;
+  BasicRouterCallback(std::nullptr_t) {}
+  BasicRouterCallback(func_type func, void* object) : m_func(func), m_object(object) {}
+
+  template <auto Member, typename T>
+  static BasicRouterCallback bind(T* object);
+
+  void                operator()(Args... args) const        { m_func(m_object, args...); }
+
+  explicit            operator bool() const                 { return m_func != nullptr; }
+  bool                operator==(std::nullptr_t) const      { return m_func == nullptr; }
+
+private:
+  func_type           m_func{};
+  void*               m_object{};
+};
+
+template <typename... Args>
+template <auto Member, typename T>
+inline BasicRouterCallback<Args...>
+BasicRouterCallback<Args...>::bind(T* object) {
+  return BasicRouterCallback([](void* object, Args... args) { (static_cast<T*>(object)->*Member)(args...); }, object);
+}
+
+// A message passed to batch handlers, the data points into the channel and is only valid until
+// the handler returns.
+struct RouterMessage {
+  void*               data;
+  uint32_t            size;
+};
+
+using RouterCallback         = BasicRouterCallback<void*, uint32_t>;
+using RouterBatchCallback    = BasicRouterCallback<std::span<const RouterMessage>>;
+using RouterWritableCallback = BasicRouterCallback<>;
+using RouterHandlerFactory   = BasicRouterCallback<uint32_t>;
+
+// Compile-time routes for well-known ids that are never closed, such as the control handlers both
+// processes register at startup. The ids are constants so the dispatch compiles to a switch on the
+// id with the member function calls inlined, instead of a slot table lookup and an indirect call.
+//
+// using routes = RouterRouteTable<Handler, RouterRoute<1, &Handler::on_read>>;
+// router->set_static_routes<routes>(handler);
+
+template <uint32_t Id, auto Member>
+struct RouterRoute {
+  constexpr static uint32_t id     = Id;
+  constexpr static auto     member = Member;
+};
+
+template <typename T, typename... Routes>
+struct RouterRouteTable {
+  using object_type = T;
+
+  constexpr static bool has_ids_below(uint32_t limit) { return ((Routes::id != 0 && Routes::id < limit) && ...); }
+
+  // Returns false if the id has no route.
+  static bool dispatch(void* object, uint32_t id, void* data, uint32_t size) {
+    return ((id == Routes::id ? ((static_cast<T*>(object)->*Routes::member)(data, size), true) : false) || ...);
+  }
+};
+
+// Limits the work done by each process_reads_*() call so that a flood of messages does not starve
+// timers and other event sources. At least one message is processed per call, and the time limit
+// is only checked every time_check_interval messages.
+struct RouterReadBudget {
+  constexpr static uint32_t time_check_interval = 32;
+
+  uint32_t                  max_bytes{~uint32_t{}};
+  uint32_t                  max_messages{~uint32_t{}};
+  std::chrono::microseconds max_time{std::chrono::microseconds::max()};
+};
+
+// Spins on the read channels before sleeping in poll, which avoids the poll call and the doorbell
+// when the other side writes again within microseconds. Disabled if max_time is zero.
+//
+// The spin limit follows twice the wait of recent hits, and is halved after each miss, bounded by
+// min_time and max_time. Spinning is disabled on single CPU systems, where the other side can't
+// write while we spin.
+struct RouterSpinPolicy {
+  std::chrono::nanoseconds max_time{};
+  std::chrono::nanoseconds min_time{std::chrono::microseconds(1)};
+};
+
+struct RouterSpinStats {
+  double              hit_rate() const { return hits + misses == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(hits + misses); }
+
+  uint64_t                 hits{};
+  uint64_t                 misses{};
+  std::chrono::nanoseconds spin_time{};
+  std::chrono::nanoseconds spin_limit{};
+};
+
+class LIBTORRENT_EXPORT RouterSpinner {
+public:
+  constexpr static uint32_t clock_check_interval = 64;
+
+  bool                    is_enabled() const { return m_enabled; }
+
+  const RouterSpinPolicy& policy() const { return m_policy; }
+  const RouterSpinStats&  stats() const  { return m_stats; }
+
+  void                    set_policy(const RouterSpinPolicy& policy);
+  void                    reset_stats();
+
+  // Spins until is_readable() returns true or the spin limit runs out, returns true on a hit.
+  template <typename Func>
+  bool                    spin(Func is_readable);
+
+private:
+  static void             cpu_relax();
+
+  void                    update(bool hit, std::chrono::nanoseconds waited);
+
+  bool                    m_enabled{};
+  RouterSpinPolicy        m_policy;
+  RouterSpinStats         m_stats;
+};
+
 struct RouterHandler {
-  using data_func = std::function<void(void* data, uint32_t size)>;
+  using data_func     = RouterCallback;
+  using batch_func    = RouterBatchCallback;
+  using writable_func = RouterWritableCallback;
 
   // We use on_error to indicate close() was called on this side, as we never call on_error after
   // close(). (nor on_read)
@@ -42,19 +183,81 @@ struct RouterHandler {
   data_func           on_read;
   data_func           on_error;
 
-  // TODO: add handler for when to resume after write failure due to full channel.
+  // Optional, if set the consecutive messages for the id are passed to on_read_batch instead of
+  // on_read.
+  batch_func          on_read_batch;
+
+  // Called after request_writable(id) once the channel has free space, or when credits are
+  // returned after a write was refused due to the credit window.
+  writable_func       on_writable;
+
+  // The lane this side writes the id's messages and close to.
+  uint32_t            lane{};
+
+  // Credit flow control, disabled if the window is zero. The writer counts unacknowledged payload
+  // bytes in credit_used, and the reader counts consumed bytes not yet returned in
+  // credit_consumed.
+  uint32_t            credit_window{};
+  uint32_t            credit_used{};
+  uint32_t            credit_consumed{};
+  bool                credit_blocked{};
+};
+
+struct RouterHandlerSlot {
+  bool                is_free() const { return id == 0; }
+
+  RouterHandler       handler;
+
+  // Full id including the generation, or 0 if the slot is free.
+  uint32_t            id{};
+  uint32_t            generation{};
+
+  uint32_t            prev_free{};
+  uint32_t            next_free{};
 };
 
 class LIBTORRENT_EXPORT Router {
 public:
-  using data_func = std::function<void(void* data, uint32_t size)>;
+  using segment_list         = std::vector<std::unique_ptr<Segment>>;
+  using data_func            = RouterCallback;
+  using batch_func           = RouterBatchCallback;
+  using writable_func        = RouterWritableCallback;
+  using handler_factory_func = RouterHandlerFactory;
+  using static_dispatch_func = bool (*)(void* object, uint32_t id, void* data, uint32_t size);
 
-  constexpr static uint32_t flag_close = 0x80000000;
-  constexpr static uint32_t flag_mask  = 0xF0000000;
+  constexpr static uint32_t flag_close   = 0x80000000;
+  constexpr static uint32_t flag_control = 0x40000000;
+  constexpr static uint32_t flag_credit  = 0x20000000;
+  constexpr static uint32_t flag_mask    = 0xF0000000;
 
-  Router(int fd, std::unique_ptr<Segment> read_segment, std::unique_ptr<Segment> write_segment);
+  // Control records use id 0 with flag_control as the record id. The payload is packed uint32_t
+  // entries of a handler id with a flag for the action, either flag_close or flag_credit followed
+  // by an entry with the number of bytes returned.
+  constexpr static uint32_t control_record_id   = flag_control;
+  constexpr static uint32_t control_max_entries = (Channel::control_headroom - Channel::header_size) / sizeof(uint32_t);
+
+  constexpr static uint32_t id_index_bits       = 20;
+  constexpr static uint32_t id_index_mask       = (1 << id_index_bits) - 1;
+  constexpr static uint32_t id_generation_mask  = ~flag_mask & ~id_index_mask;
+  constexpr static uint32_t id_generation_limit = id_generation_mask >> id_index_bits;
+
+  // Ids below this limit are never allocated by register_handler(), and may be used as static
+  // routes.
+  constexpr static uint32_t static_id_limit = 16;
+
+  // Lower priority lanes are read in slices of this many messages, after which the urgent lane is
+  // checked again.
+  constexpr static uint32_t max_lanes           = 8;
+  constexpr static uint32_t lane_slice_messages = 64;
+
+  // The segments are ordered by priority, and the other side must have the same number of lanes.
+  // The doorbell fds are the read side of this process' doorbell and the write side of the other
+  // process' doorbell, see Doorbell.
+  Router(int fd, int doorbell_wait_fd, int doorbell_ring_fd, segment_list read_segments, segment_list write_segments);
   ~Router();
 
+  uint32_t            lane_count() const { return m_write_channels.size(); }
+
   void                open_control_fd();
   void                test_close_control_fd();
 
@@ -65,44 +268,295 @@ public:
   void                register_handler(int id, data_func on_read, data_func on_error);
   bool                try_register_handler(int id, data_func on_read, data_func on_error);
 
+  // Called with the id of the first message to an id without a handler, and must register a
+  // handler for it. This lets the other side open an id and write to it without waiting for this
+  // side to register it. Without a factory such messages are an error.
+  void                set_handler_factory(handler_factory_func factory) { m_handler_factory = factory; }
+
+  // Delivers all consecutive visible messages for the id in one call. The messages are consumed
+  // from the channel after the handler returns, and stay unconsumed if it throws.
+  void                set_batch_handler(uint32_t id, batch_func on_read_batch);
+
+  // Static ids always use the urgent lane. Set the lane before the first write to the id, as
+  // messages already written to the old lane may be read after those on the new lane.
+  void                set_lane(uint32_t id, uint32_t lane);
+
+  // After a write fails due to a full channel, request a call to the writable handler once the
+  // other side has freed the channel's write threshold. Requests are one-shot, and the handlers
+  // are called from process_reads_*() when the other side signals.
+  //
+  // The router-wide request is armed on the lanes that are full, and called when one of them has
+  // drained, while id requests wait for the id's lane. Requests made while the lanes have the
+  // threshold free are called on the next process_reads_*().
+  void                set_writable_handler(writable_func on_writable);
+  void                set_writable_handler(uint32_t id, writable_func on_writable);
+
+  void                request_writable();
+  void                request_writable(uint32_t id);
+
+  // Static routes are checked before the handler table, close messages always use the handler
+  // table.
+  template <typename Table, typename T>
+  void                set_static_routes(T* object);
+  void                clear_static_routes();
+
+  // Queues a close message for the id, which is packed with other control messages and written to
+  // the channel's control headroom. Messages that don't fit are flushed after later reads, so
+  // close never fails due to a full channel.
   void                close(uint32_t id);
 
-  // TODO: Add direct write to shm channel from at-write generated data.
+  bool                has_pending_control() const;
+
+  // Opt-in per-id flow control, both sides must set the same window for the id. Writes that would
+  // exceed the payload bytes in flight are refused, and the id's writable handler is called once
+  // the reader returns credits. The reader returns credits for consumed messages after each read
+  // pass, so a window must be at least as large as the largest message, and larger writes or
+  // reservations throw internal_error.
+  void                set_credit_window(uint32_t id, uint32_t window);
+  uint32_t            available_credit(uint32_t id);
 
   bool                write(uint32_t id, uint32_t size, void* data);
 
+  // Write directly to the shm channel by building the message in place. Returns nullptr if the
+  // channel is full, otherwise the message is published with commit() or discarded with abort().
+  void*               reserve(uint32_t id, uint32_t max_size);
+  void                commit(uint32_t size);
+  void                abort();
+
+  // Batched writes are published together with a single offset store and at most one wakeup by
+  // commit_batch(), which returns the number of messages written. If batch_write() returns false
+  // the caller may either commit the messages that fit, or discard all with abort_batch().
+  //
+  // A batch writes to a single lane, and only ids on that lane may be written.
+  void                begin_batch(uint32_t lane = 0);
+  bool                batch_write(uint32_t id, uint32_t size, void* data);
+  uint32_t            commit_batch();
+  void                abort_batch();
+
+  bool                is_batching() const { return m_batching; }
+
   void                send_graceful_shutdown();
   void                send_forceful_shutdown();
 
   void                send_fatal_error(const std::string& msg);
   void                send_fatal_error(const char* msg, uint32_t size);
 
-  void                process_reads_pre_polling();
-  void                process_reads_post_polling();
+  // Returns true if messages remain after the read budget ran out, in which case the caller should
+  // poll with a zero timeout. The polling flag is not set while messages remain.
+  //
+  // With a spin policy, messages arriving while spinning are processed and true is returned so the
+  // caller can reply before polling.
+  bool                process_reads_pre_polling();
+  bool                process_reads_post_polling();
+
+  const RouterReadBudget& read_budget() const                       { return m_read_budget; }
+  void                    set_read_budget(const RouterReadBudget& budget) { m_read_budget = budget; }
+
+  const RouterSpinStats&  spin_stats() const                              { return m_spinner.stats(); }
+  void                    set_spin_policy(const RouterSpinPolicy& policy) { m_spinner.set_policy(policy); }
 
 private:
-  void                process_reads();
+  friend class RouterGroup;
+
+  struct read_usage {
+    uint64_t                              bytes{};
+    uint32_t                              messages{};
+    std::chrono::steady_clock::time_point deadline;
+
+    // Set when the budget ran out while messages remain.
+    bool                                  exhausted{};
+  };
+
+  static read_usage   start_read_usage(const RouterReadBudget& budget);
+  static bool         is_read_budget_exhausted(const RouterReadBudget& budget, const read_usage& usage);
+
+  bool                process_reads(const RouterReadBudget& budget, read_usage& usage);
+  bool                process_lane(Channel* channel, const RouterReadBudget& budget, read_usage& usage, uint32_t message_limit);
+  void                process_batch(Channel* channel, RouterHandler* handler, Channel::read_cursor& cursor, Channel::header_type* header,
+                                    const RouterReadBudget& budget, read_usage& usage, uint32_t message_limit);
+
+  bool                is_readable() const;
+
+  void                set_polling_flag();
+  void                clear_polling_flag();
+
+  Channel*            write_channel(uint32_t id);
+  uint32_t            write_lane(uint32_t id);
+
+  void                queue_control(uint32_t lane, uint32_t entry);
+  void                flush_control();
+
+  bool                acquire_credit(uint32_t id, uint32_t size);
+  void                refund_credit(uint32_t id, uint32_t size);
+  void                release_credit(uint32_t id, uint32_t size);
+  void                process_credit_writable();
+  void                consume_credit(uint32_t id, RouterHandler* handler, uint32_t size);
+  void                return_credits();
+
+  void                process_control(Channel::header_type* header);
+  void                process_close(uint32_t id);
+
+  void                signal_writable();
+  void                process_writable();
+  void                arm_writable(uint32_t lane);
+
+  void                interrupt_if_polling();
+
+  constexpr static uint32_t invalid_index = ~uint32_t{};
+
+  constexpr static uint32_t slot_chunk_bits = 8;
+  constexpr static uint32_t slot_chunk_size = 1 << slot_chunk_bits;
+  constexpr static uint32_t slot_chunk_mask = slot_chunk_size - 1;
+
+  using slot_chunk_vector = std::vector<std::unique_ptr<RouterHandlerSlot[]>>;
 
-  using handler_map = std::map<uint32_t, RouterHandler>;
+  RouterHandlerSlot*  slot_at(uint32_t index);
 
-  // TODO: Add a flag to shm that indicates if the other side is in an event loop and will soon
-  // check the channel. This avoids unnessesary writes of wakeup messages.
+  RouterHandler*      find_handler(uint32_t id);
+  RouterHandler*      insert_handler(uint32_t id);
+  RouterHandler*      create_handler(uint32_t id);
+  void                erase_handler(uint32_t id);
+
+  void                add_slot_chunk();
+  void                push_free_slot(uint32_t index);
+  void                unlink_free_slot(uint32_t index);
 
   std::unique_ptr<ControlFd> m_control_fd;
+  std::unique_ptr<Doorbell>  m_doorbell;
+
+  segment_list               m_read_segments;
+  segment_list               m_write_segments;
+
+  std::vector<Channel*> m_read_channels;
+  std::vector<Channel*> m_write_channels;
+
+  RouterReadBudget     m_read_budget;
+  RouterSpinner        m_spinner;
+  std::vector<RouterMessage> m_read_batch;
+
+  // Control entries are queued per lane, as close must follow the id's messages.
+  std::vector<std::vector<uint32_t>> m_control_queues;
+  std::vector<uint32_t>              m_credit_ids;
+  std::vector<uint32_t>              m_credit_writable_ids;
+  std::vector<uint32_t>              m_credit_writable_processing;
+
+  writable_func         m_on_writable;
+  bool                  m_writable_requested{};
+  uint32_t              m_writable_lanes{};
+  uint32_t              m_writable_ready_lanes{};
+  std::vector<uint32_t> m_writable_ids;
+  std::vector<uint32_t> m_writable_ids_processing;
+
+  handler_factory_func m_handler_factory;
 
-  std::unique_ptr<Segment>   m_read_segment;
-  std::unique_ptr<Segment>   m_write_segment;
+  static_dispatch_func m_static_dispatch{};
+  void*                m_static_object{};
 
-  Channel*            m_read_channel{};
-  Channel*            m_write_channel{};
+  slot_chunk_vector   m_slot_chunks;
+  uint32_t            m_slot_count{};
+  uint32_t            m_free_head{invalid_index};
 
-  uint32_t            m_next_id{1};
-  handler_map         m_handlers;
+  bool                  m_batching{};
+  uint32_t              m_batch_lane{};
+  uint32_t              m_batch_count{};
+  Channel::write_cursor m_batch_cursor;
+
+  // Credits acquired by the active reservation or batch, released if discarded.
+  Channel*              m_reserved_channel{};
+  uint32_t              m_reserved_id{};
+  uint32_t              m_reserved_size{};
+  std::vector<std::pair<uint32_t, uint32_t>> m_batch_credits;
 };
 
+inline void
+RouterSpinner::cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+template <typename Func>
+inline bool
+RouterSpinner::spin(Func is_readable) {
+  auto start_time = std::chrono::steady_clock::now();
+
+  for (uint32_t i = 1; ; i++) {
+    if (is_readable()) {
+      update(true, std::chrono::steady_clock::now() - start_time);
+      return true;
+    }
+
+    cpu_relax();
+
+    if (i % clock_check_interval != 0)
+      continue;
+
+    auto waited = std::chrono::steady_clock::now() - start_time;
+
+    if (waited >= m_stats.spin_limit) {
+      update(false, waited);
+      return false;
+    }
+  }
+}
+
 // inline int  Router::file_descriptor() const               { return m_fd; }
 inline void Router::send_fatal_error(const std::string& msg) { send_fatal_error(msg.c_str(), msg.size()); }
 
+template <typename Table, typename T>
+inline void
+Router::set_static_routes(T* object) {
+  static_assert(std::is_same_v<decltype(&Table::dispatch), static_dispatch_func>);
+  static_assert(Table::has_ids_below(static_id_limit), "static route ids must be non-zero and below static_id_limit");
+  static_assert(std::is_same_v<typename Table::object_type, T>, "object type must match the route table's type");
+
+  m_static_dispatch = &Table::dispatch;
+  m_static_object   = object;
+}
+
+inline void
+Router::clear_static_routes() {
+  m_static_dispatch = nullptr;
+  m_static_object   = nullptr;
+}
+
+inline RouterHandlerSlot*
+Router::slot_at(uint32_t index) {
+  return &m_slot_chunks[index >> slot_chunk_bits][index & slot_chunk_mask];
+}
+
+inline RouterHandler*
+Router::find_handler(uint32_t id) {
+  auto index = id & id_index_mask;
+
+  if (index >= m_slot_count)
+    return nullptr;
+
+  auto slot = slot_at(index);
+
+  if (slot->id != id)
+    return nullptr;
+
+  return &slot->handler;
+}
+
+inline uint32_t
+Router::write_lane(uint32_t id) {
+  if (id < static_id_limit || m_write_channels.size() == 1)
+    return 0;
+
+  auto handler = find_handler(id);
+
+  return handler != nullptr ? handler->lane : 0;
+}
+
+inline Channel*
+Router::write_channel(uint32_t id) {
+  return m_write_channels[write_lane(id)];
+}
+
 } // namespace torrent::shm
 
 #endif // LIBTORRENT_TORRENT_SHM_CHANNEL_H
@@ -0,0 +1,113 @@
+#include "config.h"
+
+#include "torrent/shm/router_group.h"
+
+#include <algorithm>
+
+#include "torrent/exceptions.h"
+#include "torrent/system/poll.h"
+
+namespace torrent::shm {
+
+void
+RouterGroup::insert(Router* router) {
+  if (std::find(m_routers.begin(), m_routers.end(), router) != m_routers.end())
+    throw torrent::internal_error("RouterGroup::insert(): router already in group");
+
+  m_routers.push_back(router);
+}
+
+void
+RouterGroup::erase(Router* router) {
+  auto itr = std::find(m_routers.begin(), m_routers.end(), router);
+
+  if (itr == m_routers.end())
+    throw torrent::internal_error("RouterGroup::erase(): router not in group");
+
+  auto index = static_cast<size_t>(itr - m_routers.begin());
+
+  m_routers.erase(itr);
+
+  if (m_next_index > index)
+    m_next_index--;
+
+  if (m_next_index >= m_routers.size())
+    m_next_index = 0;
+}
+
+bool
+RouterGroup::process_reads_pre_polling() {
+  auto usage = Router::start_read_usage(m_read_budget);
+
+  if (process_reads(usage))
+    return true;
+
+  auto is_readable = [this]() {
+      return std::any_of(m_routers.begin(), m_routers.end(), [](auto router) { return router->is_readable(); });
+    };
+
+  if (m_spinner.is_enabled() && m_spinner.spin(is_readable)) {
+    process_reads(usage);
+    return true;
+  }
+
+  for (auto router : m_routers)
+    router->set_polling_flag();
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  for (auto router : m_routers) {
+    router->signal_writable();
+    router->process_writable();
+  }
+
+  if (process_reads(usage)) {
+    for (auto router : m_routers)
+      router->clear_polling_flag();
+
+    return true;
+  }
+
+  return false;
+}
+
+bool
+RouterGroup::process_reads_post_polling() {
+  auto usage = Router::start_read_usage(m_read_budget);
+
+  for (auto router : m_routers) {
+    router->clear_polling_flag();
+    router->process_writable();
+  }
+
+  return process_reads(usage);
+}
+
+unsigned int
+RouterGroup::poll(std::chrono::microseconds timeout) {
+  if (process_reads_pre_polling())
+    timeout = 0us;
+
+  auto event_count = torrent::this_thread::poll()->do_poll(timeout.count());
+
+  process_reads_post_polling();
+  return event_count;
+}
+
+bool
+RouterGroup::process_reads(Router::read_usage& usage) {
+  auto count = m_routers.size();
+
+  for (size_t i = 0; i < count; i++) {
+    auto index = (m_next_index + i) % count;
+
+    if (m_routers[index]->process_reads(m_read_budget, usage)) {
+      m_next_index = (index + 1) % count;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+} // namespace torrent::shm
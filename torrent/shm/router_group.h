@@ -0,0 +1,62 @@
+#ifndef LIBTORRENT_TORRENT_SHM_ROUTER_GROUP_H
+#define LIBTORRENT_TORRENT_SHM_ROUTER_GROUP_H
+
+#include <vector>
+#include <torrent/common.h>
+#include <torrent/shm/router.h>
+
+// Processes the reads of many routers from a single event loop.
+//
+// The polling flags of all routers are set and cleared together around one Poll::do_poll() call,
+// so the number of polls per loop iteration does not grow with the number of routers. Routers
+// share one read budget and are drained round-robin, starting after the router that exhausted the
+// budget in the previous call.
+//
+// Routers are not owned by the group, and must be erased before they are destroyed.
+
+namespace torrent::shm {
+
+class LIBTORRENT_EXPORT RouterGroup {
+public:
+  RouterGroup() = default;
+  ~RouterGroup() = default;
+
+  bool                empty() const { return m_routers.empty(); }
+  size_t              size() const  { return m_routers.size(); }
+
+  void                insert(Router* router);
+  void                erase(Router* router);
+
+  const RouterReadBudget& read_budget() const                       { return m_read_budget; }
+  void                    set_read_budget(const RouterReadBudget& budget) { m_read_budget = budget; }
+
+  // Spins on the channels of all routers, the policies of the routers are not used.
+  const RouterSpinStats&  spin_stats() const                              { return m_spinner.stats(); }
+  void                    set_spin_policy(const RouterSpinPolicy& policy) { m_spinner.set_policy(policy); }
+
+  // Same as the Router functions, returns true if any router has messages left after the budget
+  // ran out.
+  bool                process_reads_pre_polling();
+  bool                process_reads_post_polling();
+
+  // Processes reads, polls the thread's Poll and processes reads again. The timeout is ignored if
+  // messages remain after the first pass. Poll::do_poll() already dispatches the events, and the
+  // returned count is the number of events handled.
+  unsigned int        poll(std::chrono::microseconds timeout);
+
+private:
+  RouterGroup(const RouterGroup&) = delete;
+  RouterGroup& operator=(const RouterGroup&) = delete;
+
+  bool                process_reads(Router::read_usage& usage);
+
+  std::vector<Router*> m_routers;
+  size_t               m_next_index{};
+
+  RouterReadBudget     m_read_budget;
+  RouterSpinner        m_spinner;
+};
+
+} // namespace torrent::shm
+
+#endif // LIBTORRENT_TORRENT_SHM_ROUTER_GROUP_H
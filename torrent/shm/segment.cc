@@ -4,6 +4,7 @@
 
 #include <cerrno>
 #include <cstring>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
 
@@ -12,7 +13,7 @@
 namespace torrent::shm {
 
 void
-Segment::create(uint32_t size) {
+Segment::create(size_t size) {
   if (m_addr != nullptr)
     throw torrent::internal_error("Segment::create() segment already created");
 
@@ -31,10 +32,84 @@ Segment::create(uint32_t size) {
     throw torrent::internal_error("mmap() failed: " + std::string(std::strerror(errno)));
   }
 
-  std::memset(addr, 0, size);
+  // Anonymous mappings are zero-filled by the kernel, avoid touching every page of large segments.
 
-  m_size = size;
-  m_addr = addr;
+  m_size     = size;
+  m_map_size = size;
+  m_addr     = addr;
+}
+
+static int
+create_shared_fd(size_t size) {
+#ifdef __linux__
+  int fd = ::memfd_create("shm-segment", MFD_CLOEXEC);
+
+  if (fd == -1)
+    throw torrent::internal_error("memfd_create() failed: " + std::string(std::strerror(errno)));
+
+#else
+  static std::atomic<unsigned int> counter{};
+
+  std::string name = "/shm-segment-" + std::to_string(::getpid()) + "-" + std::to_string(counter++);
+
+  int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+
+  if (fd == -1)
+    throw torrent::internal_error("shm_open() failed: " + std::string(std::strerror(errno)));
+
+  ::shm_unlink(name.c_str());
+#endif
+
+  if (::ftruncate(fd, size) == -1) {
+    int saved_errno = errno;
+    ::close(fd);
+
+    throw torrent::internal_error("ftruncate() failed: " + std::string(std::strerror(saved_errno)));
+  }
+
+  return fd;
+}
+
+void
+Segment::create_mirrored(size_t size) {
+  if (m_addr != nullptr)
+    throw torrent::internal_error("Segment::create_mirrored() segment already created");
+
+  if (m_size != 0)
+    throw torrent::internal_error("Segment::create_mirrored() segment size already set");
+
+  if (size <= page_size || (size % page_size) != 0)
+    throw std::invalid_argument("Segment::create_mirrored() size must be larger than and a multiple of page size");
+
+  size_t map_size = 2 * size - page_size;
+
+  // Reserve the address range first so the two mappings are guaranteed to be adjacent.
+  void* addr = mmap(nullptr, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (addr == MAP_FAILED)
+    throw torrent::internal_error("mmap() failed to reserve address range: " + std::string(std::strerror(errno)));
+
+  int fd = create_shared_fd(size);
+
+  void* primary = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+  void* mirror  = MAP_FAILED;
+
+  if (primary != MAP_FAILED)
+    mirror = mmap(static_cast<char*>(addr) + size, size - page_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, page_size);
+
+  int saved_errno = errno;
+  ::close(fd);
+
+  if (primary == MAP_FAILED || mirror == MAP_FAILED) {
+    munmap(addr, map_size);
+    throw torrent::internal_error("mmap() failed to map mirrored segment: " + std::string(std::strerror(saved_errno)));
+  }
+
+  // The memfd is zero-filled by ftruncate, avoid touching every page of large segments.
+
+  m_size     = size;
+  m_map_size = map_size;
+  m_addr     = addr;
 }
 
 void
@@ -42,11 +117,12 @@ Segment::destroy() {
   if (m_addr == nullptr)
     return;
 
-  if (munmap(m_addr, m_size) == -1)
+  if (munmap(m_addr, m_map_size) == -1)
     throw torrent::internal_error("munmap() failed: " + std::string(std::strerror(errno)));
 
-  m_size = 0;
-  m_addr = nullptr;
+  m_size     = 0;
+  m_map_size = 0;
+  m_addr     = nullptr;
 }
 
 } // namespace torrent::shm
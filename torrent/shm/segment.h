@@ -14,21 +14,29 @@ public:
   Segment() = default;
   ~Segment();
 
-  void                create(uint32_t size);
+  void                create(size_t size);
   void                destroy();
 
+  // Maps the segment followed by a second mapping of everything but the first page, so that data
+  // starting at the second page can be accessed past the end of the segment without wrapping.
+  void                create_mirrored(size_t size);
+
   void*               address()    { return m_addr; }
   size_t              size() const { return m_size; }
 
+  bool                is_mirrored() const { return m_map_size != m_size; }
+
 private:
   size_t              m_size{};
+  size_t              m_map_size{};
   void*               m_addr{};
 };
 
 inline
 Segment::~Segment() {
-  m_size = 0;
-  m_addr = nullptr;
+  m_size     = 0;
+  m_map_size = 0;
+  m_addr     = nullptr;
 }
 
 }
@@ -0,0 +1,544 @@
+#include "config.h"
+
+#ifdef USE_EPOLL
+
+#include "torrent/system/poll.h"
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "torrent/event.h"
+#include "torrent/exceptions.h"
+#include "torrent/system/thread.h"
+
+// TODO: Change to LOG_CONNECTION_POLL
+
+// TODO: Optimize table memory size, and add a reference to Event for direct lookup.
+
+#define LT_LOG(log_fmt, ...)
+
+#define LT_LOG_EVENT(log_fmt, ...)
+
+#if 1
+
+#define LT_LOG_DEBUG(log_fmt, ...)
+#define LT_LOG_DEBUG_IDENT(log_fmt, ...)
+
+#else
+
+#define LT_LOG_DEBUG(log_fmt, ...)                                  \
+  lt_log_print(LOG_CONNECTION_FD, "epoll: " log_fmt, __VA_ARGS__);
+#define LT_LOG_DEBUG_IDENT(log_fmt, ...)                                \
+  lt_log_print(LOG_CONNECTION_FD, "epoll->%i : " log_fmt, poll_event->event->file_descriptor(), __VA_ARGS__);
+
+#endif
+
+namespace torrent::system {
+
+class PollEvent {
+public:
+  PollEvent(Event* e) : event(e) {}
+  ~PollEvent() = default;
+
+  uint32_t            mask{};
+  Event*              event{};
+
+  // The epoll events currently registered with the kernel, only valid if 'registered' is set.
+  uint32_t            registered_events{};
+  bool                registered{false};
+  bool                changed{false};
+};
+
+// Epoll has no way to submit several changes in one syscall, so instead of calling epoll_ctl on
+// every insert/remove we mark the PollEvent as changed and reconcile the mask with the kernel
+// once before polling. Inserts and removes that cancel out within a loop iteration cost nothing,
+// and read/write changes on the same fd collapse into a single EPOLL_CTL_MOD.
+
+class PollInternal {
+public:
+  using Table = std::map<unsigned int, std::shared_ptr<PollEvent>>;
+  using ChangedList = std::vector<std::shared_ptr<PollEvent>>;
+
+  static constexpr uint32_t flag_read  = 0x1;
+  static constexpr uint32_t flag_write = 0x2;
+  static constexpr uint32_t flag_error = 0x4;
+
+  uint32_t            event_mask(Event* event);
+  void                set_event_mask(Event* event, uint32_t mask);
+
+  void                flush();
+  void                flush_event(PollEvent* poll_event);
+
+  inline void         create_user_event();
+  inline void         poke_user_event();
+  inline void         clear_user_event();
+
+  int                 m_fd{-1};
+  int                 m_user_fd{-1};
+
+  unsigned int        m_max_sockets{};
+  unsigned int        m_max_events{};
+  unsigned int        m_waiting_events{};
+
+  Table                                 m_table;
+  ChangedList                           m_changes;
+  std::unique_ptr<struct epoll_event[]> m_events;
+};
+
+uint32_t
+PollInternal::event_mask(Event* event) {
+  // TODO: Replace `file_descriptor()` with m_event_poll.
+
+  if (event->file_descriptor() == -1)
+    throw internal_error("PollInternal::event_mask() invalid file descriptor for event: " + event->print_name_fd_str());
+
+  auto itr = m_table.find(event->file_descriptor());
+
+  if (itr == m_table.end())
+    throw internal_error("PollInternal::event_mask() event not found: " + event->print_name_fd_str());
+
+  if (event != itr->second->event)
+    throw internal_error("PollInternal::event_mask() event mismatch: " + event->print_name_fd_str());
+
+  return itr->second->mask;
+}
+
+void
+PollInternal::set_event_mask(Event* event, uint32_t mask) {
+  if (event->file_descriptor() == -1)
+    throw internal_error("PollInternal::set_event_mask() invalid file descriptor for event: " + event->print_name_fd_str());
+
+  auto& poll_event = event->m_poll_event;
+
+  poll_event->mask = mask;
+
+  if (poll_event->changed)
+    return;
+
+  poll_event->changed = true;
+  m_changes.push_back(poll_event);
+}
+
+void
+PollInternal::flush() {
+  if (m_changes.empty())
+    return;
+
+  LT_LOG_DEBUG("flushing events : changed:%zu", m_changes.size());
+
+  for (auto& poll_event : m_changes) {
+    if (!poll_event->changed)
+      continue;
+
+    flush_event(poll_event.get());
+  }
+
+  m_changes.clear();
+}
+
+void
+PollInternal::flush_event(PollEvent* poll_event) {
+  poll_event->changed = false;
+
+  if (poll_event->event == nullptr)
+    return;
+
+  uint32_t events{};
+
+  if (poll_event->mask & flag_read)
+    events |= EPOLLIN;
+  if (poll_event->mask & flag_write)
+    events |= EPOLLOUT;
+
+  int op;
+
+  if (poll_event->mask == 0) {
+    if (!poll_event->registered)
+      return;
+
+    op = EPOLL_CTL_DEL;
+
+  } else if (!poll_event->registered) {
+    op = EPOLL_CTL_ADD;
+
+  } else {
+    if (poll_event->registered_events == events)
+      return;
+
+    op = EPOLL_CTL_MOD;
+  }
+
+  LT_LOG_EVENT("modify event : op:%i events:%x", op, events);
+
+  // Errors and hangups are always reported by epoll, so an event that only wants errors is
+  // registered with an empty event set.
+  struct epoll_event ctl_event{};
+  ctl_event.events   = events;
+  ctl_event.data.ptr = poll_event;
+
+  if (::epoll_ctl(m_fd, op, poll_event->event->file_descriptor(), &ctl_event) == -1)
+    throw internal_error("PollInternal::flush_event() epoll_ctl failed: " + poll_event->event->print_name_fd_str() + " : " + std::string(std::strerror(errno)));
+
+  poll_event->registered        = (op != EPOLL_CTL_DEL);
+  poll_event->registered_events = events;
+}
+
+inline void
+PollInternal::create_user_event() {
+  m_user_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (m_user_fd == -1)
+    throw internal_error("PollInternal::create_user_event() eventfd failed: " + std::string(std::strerror(errno)));
+
+  // The user event is identified by a null data pointer.
+  struct epoll_event event{};
+  event.events   = EPOLLIN;
+  event.data.ptr = nullptr;
+
+  if (::epoll_ctl(m_fd, EPOLL_CTL_ADD, m_user_fd, &event) == -1)
+    throw internal_error("PollInternal::create_user_event() error: " + std::string(std::strerror(errno)));
+}
+
+inline void
+PollInternal::poke_user_event() {
+  uint64_t value = 1;
+
+  // Called from other threads to interrupt the poll.
+  if (::write(m_user_fd, &value, sizeof(value)) == -1) {
+    if (m_user_fd == -1)
+      return; // The poll was already closed, so ignore this error.
+
+    if (errno == EAGAIN)
+      return; // Counter is saturated, the poll will wake up regardless.
+
+    throw internal_error("PollInternal::poke_user_event() error: " + std::string(std::strerror(errno)));
+  }
+}
+
+inline void
+PollInternal::clear_user_event() {
+  uint64_t value{};
+
+  if (::read(m_user_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+    throw internal_error("PollInternal::clear_user_event() error: " + std::string(std::strerror(errno)));
+}
+
+std::unique_ptr<Poll>
+Poll::create() {
+  auto socket_open_max = sysconf(_SC_OPEN_MAX);
+
+  if (socket_open_max == -1)
+    throw internal_error("Poll::create() : sysconf(_SC_OPEN_MAX) failed : " + std::string(std::strerror(errno)));
+
+  int fd = ::epoll_create1(EPOLL_CLOEXEC);
+
+  if (fd == -1)
+    throw internal_error("Poll::create() : epoll_create1() failed : " + std::string(std::strerror(errno)));
+
+  auto poll = new Poll();
+
+  poll->m_internal                = std::make_unique<PollInternal>();
+  poll->m_internal->m_fd          = fd;
+  poll->m_internal->m_max_sockets = static_cast<unsigned int>(socket_open_max);
+  poll->m_internal->m_max_events  = 1024;
+  poll->m_internal->m_events      = std::make_unique<struct epoll_event[]>(poll->m_internal->m_max_events);
+
+  poll->m_internal->m_changes.reserve(poll->m_internal->m_max_events);
+
+  poll->m_internal->create_user_event();
+
+  return std::unique_ptr<Poll>(poll);
+}
+
+Poll::~Poll() {
+  assert(m_internal->m_table.empty() && "Poll::~Poll() called with non-empty event table.");
+
+  ::close(m_internal->m_user_fd);
+  m_internal->m_user_fd = -1;
+
+  ::close(m_internal->m_fd);
+  m_internal->m_fd = -1;
+}
+
+void
+Poll::init_thread() {
+}
+
+void
+Poll::cleanup_thread() {
+}
+
+unsigned int
+Poll::do_poll(int64_t timeout_usec) {
+  int status = poll(timeout_usec);
+
+  if (status == -1) {
+    if (errno != EINTR)
+      throw internal_error("Poll::do_poll() error: " + std::string(std::strerror(errno)));
+
+    return 0;
+  }
+
+  return process();
+}
+
+int
+Poll::poll(int timeout_usec) {
+  // Round up so that a short timeout doesn't turn into a busy loop.
+  int timeout_msec = (timeout_usec + 999) / 1000;
+
+  m_internal->flush();
+
+  auto previous_state = m_polling_state.fetch_or(flag_polling, std::memory_order_acquire);
+
+  if (previous_state & flag_interrupted || system::Thread::self()->has_any_callbacks())
+    timeout_msec = 0;
+
+  int nfds = ::epoll_wait(m_internal->m_fd,
+                          m_internal->m_events.get(),
+                          m_internal->m_max_events,
+                          timeout_msec);
+
+  m_polling_state.fetch_and(~flag_state_mask, std::memory_order_release);
+
+  if (nfds == -1)
+    return -1;
+
+  m_internal->m_waiting_events = nfds;
+  return nfds;
+}
+
+void
+Poll::do_interrupt() {
+  int expected_state = flag_polling;
+
+  if (!m_polling_state.compare_exchange_strong(expected_state, flag_polling | flag_interrupted,
+                                               std::memory_order_release, std::memory_order_relaxed))
+    return;
+
+  m_internal->poke_user_event();
+}
+
+unsigned int
+Poll::process() {
+  unsigned int count{};
+
+  m_processing = true;
+  m_closed_events.clear();
+
+  for (struct epoll_event *itr = m_internal->m_events.get(), *last = m_internal->m_events.get() + m_internal->m_waiting_events; itr != last; ++itr) {
+    if (system::Thread::self()->has_interrupt_callbacks())
+      system::Thread::self()->process_callbacks(true);
+
+    auto* poll_event = static_cast<PollEvent*>(itr->data.ptr);
+
+    if (poll_event == nullptr) {
+      m_internal->clear_user_event();
+      continue;
+    }
+
+    if (poll_event->event == nullptr)
+      continue;
+
+    // EPOLLERR is a pending socket error, e.g. a reset, which kqueue reports as EV_EOF on the
+    // filters, so it is only an error event if the event asked for errors. Hangups stay level
+    // triggered, and go to event_error if the event doesn't read.
+    bool is_error = (itr->events & EPOLLERR) || ((itr->events & EPOLLHUP) && !(poll_event->mask & PollInternal::flag_read));
+
+    if (is_error && (poll_event->mask & PollInternal::flag_error)) {
+      count++;
+
+      auto event_info = poll_event->event->print_name_fd_str();
+
+      poll_event->event->event_error();
+
+      if (poll_event->mask != 0)
+        throw internal_error("Poll::process() event_error called but event mask not cleared: " + event_info);
+
+      // We assume that the event gets closed if we get an error.
+      continue;
+    }
+
+    // Hangups are delivered as reads so that the event sees the end-of-file.
+    if ((itr->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && (poll_event->mask & PollInternal::flag_read)) {
+      count++;
+      poll_event->event->event_read();
+    }
+    else if ((itr->events & EPOLLIN)) {
+      LT_LOG_DEBUG_IDENT("spurious read event, skipping", 0);
+    }
+
+    if ((itr->events & (EPOLLOUT | EPOLLERR)) && (poll_event->mask & PollInternal::flag_write)) {
+      count++;
+      poll_event->event->event_write();
+    }
+    else if ((itr->events & EPOLLOUT)) {
+      LT_LOG_DEBUG_IDENT("spurious write event, skipping", 0);
+    }
+  }
+
+  m_closed_events.clear();
+  m_processing = false;
+
+  m_internal->m_waiting_events = 0;
+
+  return count;
+}
+
+uint32_t
+Poll::open_max() const {
+  return m_internal->m_max_sockets;
+}
+
+void
+Poll::open(Event* event) {
+  LT_LOG_EVENT("open event", 0);
+
+  if (event->file_descriptor() == -1)
+    throw internal_error("Poll::open() invalid file descriptor for event: " + event->print_name_fd_str());
+
+  if (event->m_poll_event != nullptr)
+    throw internal_error("Poll::open() called but the event is already associated with a poll: " + event->print_name_fd_str());
+
+  if (m_internal->m_table.find(event->file_descriptor()) != m_internal->m_table.end())
+    throw internal_error("Poll::open() event already exists: " + event->print_name_fd_str());
+
+  event->m_poll_event = std::make_shared<PollEvent>(event);
+
+  m_internal->m_table[event->file_descriptor()] = event->m_poll_event;
+}
+
+void
+Poll::close(Event* event) {
+  LT_LOG_EVENT("close event", 0);
+
+  auto* poll_event = event->m_poll_event.get();
+
+  if (poll_event == nullptr)
+    return;
+
+  if (poll_event->event != event)
+    throw internal_error("Poll::close() event mismatch: " + event->print_name_fd_str());
+
+  if (m_internal->event_mask(event) != 0)
+    throw internal_error("Poll::close() called but the file descriptor is active: " + event->print_name_fd_str());
+
+  if (m_internal->m_table.erase(event->file_descriptor()) == 0)
+    throw internal_error("Poll::close() event not found: " + event->print_name_fd_str());
+
+  // The caller closes the fd after this returns, so the kernel registration must be removed now
+  // rather than at the next flush.
+  m_internal->flush_event(poll_event);
+
+  if (m_processing)
+    m_closed_events.push_back(event->m_poll_event);
+
+  poll_event->event   = nullptr;
+  event->m_poll_event = nullptr;
+}
+
+bool
+Poll::in_read(Event* event) {
+  return m_internal->event_mask(event) & PollInternal::flag_read;
+}
+
+bool
+Poll::in_write(Event* event) {
+  return m_internal->event_mask(event) & PollInternal::flag_write;
+}
+
+bool
+Poll::in_error(Event* event) {
+  return m_internal->event_mask(event) & PollInternal::flag_error;
+}
+
+void
+Poll::insert_read(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (event_mask & PollInternal::flag_read)
+    return;
+
+  LT_LOG_EVENT("insert read", 0);
+
+  m_internal->set_event_mask(event, event_mask | PollInternal::flag_read);
+}
+
+void
+Poll::insert_write(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (event_mask & PollInternal::flag_write)
+    return;
+
+  LT_LOG_EVENT("insert write", 0);
+
+  m_internal->set_event_mask(event, event_mask | PollInternal::flag_write);
+}
+
+void
+Poll::insert_error(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (event_mask & PollInternal::flag_error)
+    return;
+
+  LT_LOG_EVENT("insert error", 0);
+
+  m_internal->set_event_mask(event, event_mask | PollInternal::flag_error);
+}
+
+void
+Poll::remove_read(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (!(event_mask & PollInternal::flag_read))
+    return;
+
+  LT_LOG_EVENT("remove read", 0);
+
+  m_internal->set_event_mask(event, event_mask & ~PollInternal::flag_read);
+}
+
+void
+Poll::remove_write(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (!(event_mask & PollInternal::flag_write))
+    return;
+
+  LT_LOG_EVENT("remove write", 0);
+
+  m_internal->set_event_mask(event, event_mask & ~PollInternal::flag_write);
+}
+
+void
+Poll::remove_error(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (!(event_mask & PollInternal::flag_error))
+    return;
+
+  LT_LOG_EVENT("remove error", 0);
+
+  m_internal->set_event_mask(event, event_mask & ~PollInternal::flag_error);
+}
+
+void
+Poll::remove_and_close(Event* event) {
+  LT_LOG_EVENT("remove and close", 0);
+
+  remove_read(event);
+  remove_write(event);
+  remove_error(event);
+
+  close(event);
+}
+
+}
+
+#endif // USE_EPOLL
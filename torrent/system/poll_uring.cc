@@ -0,0 +1,794 @@
+#include "config.h"
+
+#ifdef USE_IO_URING
+
+#include "torrent/system/poll.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <csignal>
+#include <cstring>
+#include <map>
+#include <poll.h>
+#include <unordered_map>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "torrent/event.h"
+#include "torrent/exceptions.h"
+#include "torrent/system/thread.h"
+
+// TODO: Change to LOG_CONNECTION_POLL
+
+#define LT_LOG(log_fmt, ...)
+
+#define LT_LOG_EVENT(log_fmt, ...)
+
+#if 1
+
+#define LT_LOG_DEBUG(log_fmt, ...)
+#define LT_LOG_DEBUG_IDENT(log_fmt, ...)
+
+#else
+
+#define LT_LOG_DEBUG(log_fmt, ...)                                  \
+  lt_log_print(LOG_CONNECTION_FD, "io_uring: " log_fmt, __VA_ARGS__);
+#define LT_LOG_DEBUG_IDENT(log_fmt, ...)                                \
+  lt_log_print(LOG_CONNECTION_FD, "io_uring->%i : " log_fmt, poll_event->event->file_descriptor(), __VA_ARGS__);
+
+#endif
+
+namespace torrent::system {
+
+class PollEvent {
+public:
+  PollEvent(Event* e) : event(e) {}
+  ~PollEvent() = default;
+
+  uint32_t            mask{};
+  Event*              event{};
+
+  // The poll events of the request in the ring, only valid if 'armed' is set.
+  uint32_t            armed_events{};
+  bool                armed{false};
+  bool                changed{false};
+};
+
+// Uses io_uring poll requests, with changes queued in the submission ring and submitted together
+// with the wait for completions in a single io_uring_enter() per loop iteration.
+//
+// Multishot polls only complete on new wakeups, while Event handlers rely on level triggered
+// readiness, e.g. ControlFd reads one message per event. Instead a one-shot poll is re-armed after
+// each completion as part of the next submission, and completes right away if the fd is still
+// ready.
+//
+// The kernel may complete a request after the Event is closed, so armed requests hold a reference
+// to their PollEvent until the completion is reaped.
+
+class PollInternal {
+public:
+  using Table       = std::map<unsigned int, std::shared_ptr<PollEvent>>;
+  using ChangedList = std::vector<std::shared_ptr<PollEvent>>;
+  using ArmedMap    = std::unordered_map<PollEvent*, std::shared_ptr<PollEvent>>;
+
+  struct completion {
+    uint64_t          user_data;
+    int32_t           result;
+  };
+
+  static constexpr uint32_t flag_read  = 0x1;
+  static constexpr uint32_t flag_write = 0x2;
+  static constexpr uint32_t flag_error = 0x4;
+
+  // Never valid PollEvent pointers.
+  static constexpr uint64_t user_data_user_event = 0;
+  static constexpr uint64_t user_data_remove     = 1;
+
+  uint32_t            event_mask(Event* event);
+  void                set_event_mask(Event* event, uint32_t mask);
+
+  void                flush();
+  void                flush_event(const std::shared_ptr<PollEvent>& poll_event);
+
+  void                create_ring(unsigned int entries);
+  void                destroy_ring();
+
+  struct io_uring_sqe* next_sqe();
+  void                queue_poll_add(uint64_t user_data, int fd, uint32_t events);
+  void                queue_poll_remove(PollEvent* poll_event);
+
+  int                 enter(unsigned int min_complete, unsigned int flags, struct __kernel_timespec* timeout);
+  void                submit();
+  void                reap();
+
+  std::shared_ptr<PollEvent> take_armed(PollEvent* poll_event);
+
+  inline void         create_user_event();
+  inline void         poke_user_event();
+  inline void         clear_user_event();
+
+  int                 m_fd{-1};
+  int                 m_user_fd{-1};
+  bool                m_user_armed{};
+
+  unsigned int        m_max_sockets{};
+  unsigned int        m_max_events{};
+  unsigned int        m_waiting_events{};
+
+  void*               m_sq_ring{};
+  size_t              m_sq_ring_size{};
+  void*               m_cq_ring{};
+  size_t              m_cq_ring_size{};
+  io_uring_sqe*       m_sqes{};
+  size_t              m_sqes_size{};
+
+  unsigned int*       m_sq_head{};
+  unsigned int*       m_sq_tail{};
+  unsigned int        m_sq_mask{};
+  unsigned int        m_sq_entries{};
+  unsigned int        m_sq_local_tail{};
+
+  unsigned int*       m_cq_head{};
+  unsigned int*       m_cq_tail{};
+  unsigned int        m_cq_mask{};
+  io_uring_cqe*       m_cqes{};
+
+  Table                   m_table;
+  ChangedList             m_changes;
+  ArmedMap                m_armed;
+  std::vector<completion> m_events;
+};
+
+static inline unsigned int
+ring_load_acquire(unsigned int* value) {
+  return std::atomic_ref<unsigned int>(*value).load(std::memory_order_acquire);
+}
+
+static inline void
+ring_store_release(unsigned int* value, unsigned int new_value) {
+  std::atomic_ref<unsigned int>(*value).store(new_value, std::memory_order_release);
+}
+
+uint32_t
+PollInternal::event_mask(Event* event) {
+  if (event->file_descriptor() == -1)
+    throw internal_error("PollInternal::event_mask() invalid file descriptor for event: " + event->print_name_fd_str());
+
+  auto itr = m_table.find(event->file_descriptor());
+
+  if (itr == m_table.end())
+    throw internal_error("PollInternal::event_mask() event not found: " + event->print_name_fd_str());
+
+  if (event != itr->second->event)
+    throw internal_error("PollInternal::event_mask() event mismatch: " + event->print_name_fd_str());
+
+  return itr->second->mask;
+}
+
+void
+PollInternal::set_event_mask(Event* event, uint32_t mask) {
+  if (event->file_descriptor() == -1)
+    throw internal_error("PollInternal::set_event_mask() invalid file descriptor for event: " + event->print_name_fd_str());
+
+  auto& poll_event = event->m_poll_event;
+
+  poll_event->mask = mask;
+
+  if (poll_event->changed)
+    return;
+
+  poll_event->changed = true;
+  m_changes.push_back(poll_event);
+}
+
+void
+PollInternal::flush() {
+  if (!m_user_armed) {
+    queue_poll_add(user_data_user_event, m_user_fd, POLLIN);
+    m_user_armed = true;
+  }
+
+  if (m_changes.empty())
+    return;
+
+  LT_LOG_DEBUG("flushing events : changed:%zu", m_changes.size());
+
+  for (auto& poll_event : m_changes) {
+    if (!poll_event->changed)
+      continue;
+
+    flush_event(poll_event);
+  }
+
+  m_changes.clear();
+}
+
+// Requests can't be modified in place, so a request with the wrong events is removed and the
+// event is re-armed when the cancelled request completes.
+void
+PollInternal::flush_event(const std::shared_ptr<PollEvent>& poll_event) {
+  poll_event->changed = false;
+
+  if (poll_event->event == nullptr)
+    return;
+
+  uint32_t events{};
+
+  if (poll_event->mask & flag_read)
+    events |= POLLIN;
+  if (poll_event->mask & flag_write)
+    events |= POLLOUT;
+
+  if (poll_event->mask == 0) {
+    if (poll_event->armed)
+      queue_poll_remove(poll_event.get());
+
+    return;
+  }
+
+  if (poll_event->armed) {
+    if (poll_event->armed_events != events)
+      queue_poll_remove(poll_event.get());
+
+    return;
+  }
+
+  LT_LOG_EVENT("arm event : events:%x", events);
+
+  // Errors and hangups are always reported, so an event that only wants errors is armed with an
+  // empty event set.
+  queue_poll_add(reinterpret_cast<uint64_t>(poll_event.get()), poll_event->event->file_descriptor(), events);
+
+  poll_event->armed        = true;
+  poll_event->armed_events = events;
+
+  m_armed.emplace(poll_event.get(), poll_event);
+}
+
+void
+PollInternal::create_ring(unsigned int entries) {
+  struct io_uring_params params{};
+
+  m_fd = ::syscall(__NR_io_uring_setup, entries, &params);
+
+  if (m_fd == -1)
+    throw internal_error("PollInternal::create_ring() io_uring_setup failed: " + std::string(std::strerror(errno)));
+
+  if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+    throw internal_error("PollInternal::create_ring() io_uring lacks required features, use epoll");
+
+  m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+
+  m_sq_ring = ::mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+
+  if (m_sq_ring == MAP_FAILED)
+    throw internal_error("PollInternal::create_ring() mmap of submission ring failed: " + std::string(std::strerror(errno)));
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    m_cq_ring = m_sq_ring;
+  } else {
+    m_cq_ring = ::mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+
+    if (m_cq_ring == MAP_FAILED)
+      throw internal_error("PollInternal::create_ring() mmap of completion ring failed: " + std::string(std::strerror(errno)));
+  }
+
+  m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  m_sqes      = static_cast<io_uring_sqe*>(::mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+
+  if (m_sqes == MAP_FAILED)
+    throw internal_error("PollInternal::create_ring() mmap of submission entries failed: " + std::string(std::strerror(errno)));
+
+  auto sq_ring = static_cast<char*>(m_sq_ring);
+  auto cq_ring = static_cast<char*>(m_cq_ring);
+
+  m_sq_head       = reinterpret_cast<unsigned int*>(sq_ring + params.sq_off.head);
+  m_sq_tail       = reinterpret_cast<unsigned int*>(sq_ring + params.sq_off.tail);
+  m_sq_mask       = *reinterpret_cast<unsigned int*>(sq_ring + params.sq_off.ring_mask);
+  m_sq_entries    = params.sq_entries;
+  m_sq_local_tail = *m_sq_tail;
+
+  // Submission entries are used in ring order, so the index array is fixed.
+  auto sq_array = reinterpret_cast<unsigned int*>(sq_ring + params.sq_off.array);
+
+  for (unsigned int i = 0; i < m_sq_entries; i++)
+    sq_array[i] = i;
+
+  m_cq_head = reinterpret_cast<unsigned int*>(cq_ring + params.cq_off.head);
+  m_cq_tail = reinterpret_cast<unsigned int*>(cq_ring + params.cq_off.tail);
+  m_cq_mask = *reinterpret_cast<unsigned int*>(cq_ring + params.cq_off.ring_mask);
+  m_cqes    = reinterpret_cast<io_uring_cqe*>(cq_ring + params.cq_off.cqes);
+
+  m_events.reserve(params.cq_entries);
+}
+
+void
+PollInternal::destroy_ring() {
+  if (m_sqes != nullptr && m_sqes != MAP_FAILED)
+    ::munmap(m_sqes, m_sqes_size);
+
+  if (m_cq_ring != nullptr && m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+    ::munmap(m_cq_ring, m_cq_ring_size);
+
+  if (m_sq_ring != nullptr && m_sq_ring != MAP_FAILED)
+    ::munmap(m_sq_ring, m_sq_ring_size);
+
+  m_sqes    = nullptr;
+  m_cq_ring = nullptr;
+  m_sq_ring = nullptr;
+
+  ::close(m_fd);
+  m_fd = -1;
+}
+
+// Submits queued entries if the submission ring is full.
+io_uring_sqe*
+PollInternal::next_sqe() {
+  if (m_sq_local_tail - ring_load_acquire(m_sq_head) == m_sq_entries) {
+    submit();
+
+    if (m_sq_local_tail - ring_load_acquire(m_sq_head) == m_sq_entries)
+      throw internal_error("PollInternal::next_sqe() submission ring is full");
+  }
+
+  auto sqe = &m_sqes[m_sq_local_tail & m_sq_mask];
+
+  std::memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+void
+PollInternal::queue_poll_add(uint64_t user_data, int fd, uint32_t events) {
+  auto sqe = next_sqe();
+
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = fd;
+  sqe->poll32_events = events;
+  sqe->user_data     = user_data;
+
+  ring_store_release(m_sq_tail, ++m_sq_local_tail);
+}
+
+void
+PollInternal::queue_poll_remove(PollEvent* poll_event) {
+  auto sqe = next_sqe();
+
+  sqe->opcode    = IORING_OP_POLL_REMOVE;
+  sqe->fd        = -1;
+  sqe->addr      = reinterpret_cast<uint64_t>(poll_event);
+  sqe->user_data = user_data_remove;
+
+  ring_store_release(m_sq_tail, ++m_sq_local_tail);
+}
+
+// Entries the kernel did not consume, e.g. when interrupted, remain queued for the next call.
+int
+PollInternal::enter(unsigned int min_complete, unsigned int flags, struct __kernel_timespec* timeout) {
+  unsigned int to_submit = m_sq_local_tail - ring_load_acquire(m_sq_head);
+
+  if (timeout == nullptr)
+    return ::syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, nullptr, 0);
+
+  struct io_uring_getevents_arg arg{};
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts         = reinterpret_cast<uint64_t>(timeout);
+
+  return ::syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+void
+PollInternal::submit() {
+  if (m_sq_local_tail == ring_load_acquire(m_sq_head))
+    return;
+
+  while (enter(0, 0, nullptr) == -1) {
+    if (errno == EINTR)
+      continue;
+
+    throw internal_error("PollInternal::submit() io_uring_enter failed: " + std::string(std::strerror(errno)));
+  }
+}
+
+// Completions are copied out of the ring, so handlers may queue new entries while processing.
+void
+PollInternal::reap() {
+  unsigned int head = *m_cq_head;
+  unsigned int tail = ring_load_acquire(m_cq_tail);
+
+  for (; head != tail; head++) {
+    auto cqe = &m_cqes[head & m_cq_mask];
+
+    m_events.push_back(completion{cqe->user_data, cqe->res});
+  }
+
+  ring_store_release(m_cq_head, head);
+}
+
+std::shared_ptr<PollEvent>
+PollInternal::take_armed(PollEvent* poll_event) {
+  auto itr = m_armed.find(poll_event);
+
+  if (itr == m_armed.end())
+    throw internal_error("PollInternal::take_armed() completion for unknown poll request");
+
+  auto result = std::move(itr->second);
+  m_armed.erase(itr);
+
+  result->armed = false;
+  return result;
+}
+
+inline void
+PollInternal::create_user_event() {
+  m_user_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (m_user_fd == -1)
+    throw internal_error("PollInternal::create_user_event() eventfd failed: " + std::string(std::strerror(errno)));
+}
+
+inline void
+PollInternal::poke_user_event() {
+  uint64_t value = 1;
+
+  // Called from other threads to interrupt the poll.
+  if (::write(m_user_fd, &value, sizeof(value)) == -1) {
+    if (m_user_fd == -1)
+      return; // The poll was already closed, so ignore this error.
+
+    if (errno == EAGAIN)
+      return; // Counter is saturated, the poll will wake up regardless.
+
+    throw internal_error("PollInternal::poke_user_event() error: " + std::string(std::strerror(errno)));
+  }
+}
+
+inline void
+PollInternal::clear_user_event() {
+  uint64_t value{};
+
+  if (::read(m_user_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+    throw internal_error("PollInternal::clear_user_event() error: " + std::string(std::strerror(errno)));
+}
+
+std::unique_ptr<Poll>
+Poll::create() {
+  auto socket_open_max = sysconf(_SC_OPEN_MAX);
+
+  if (socket_open_max == -1)
+    throw internal_error("Poll::create() : sysconf(_SC_OPEN_MAX) failed : " + std::string(std::strerror(errno)));
+
+  auto poll = new Poll();
+
+  poll->m_internal                = std::make_unique<PollInternal>();
+  poll->m_internal->m_max_sockets = static_cast<unsigned int>(socket_open_max);
+  poll->m_internal->m_max_events  = 1024;
+
+  poll->m_internal->m_changes.reserve(poll->m_internal->m_max_events);
+
+  poll->m_internal->create_ring(poll->m_internal->m_max_events);
+  poll->m_internal->create_user_event();
+
+  return std::unique_ptr<Poll>(poll);
+}
+
+Poll::~Poll() {
+  assert(m_internal->m_table.empty() && "Poll::~Poll() called with non-empty event table.");
+
+  // Closing the ring cancels the remaining requests.
+  m_internal->destroy_ring();
+  m_internal->m_armed.clear();
+
+  ::close(m_internal->m_user_fd);
+  m_internal->m_user_fd = -1;
+}
+
+void
+Poll::init_thread() {
+}
+
+void
+Poll::cleanup_thread() {
+}
+
+unsigned int
+Poll::do_poll(int64_t timeout_usec) {
+  int status = poll(timeout_usec);
+
+  if (status == -1) {
+    if (errno != EINTR)
+      throw internal_error("Poll::do_poll() error: " + std::string(std::strerror(errno)));
+
+    return 0;
+  }
+
+  return process();
+}
+
+// Submits the queued changes and waits for completions in one call. A timeout of zero only reaps
+// the completions that are ready.
+int
+Poll::poll(int timeout_usec) {
+  m_internal->flush();
+
+  auto previous_state = m_polling_state.fetch_or(flag_polling, std::memory_order_acquire);
+
+  if (previous_state & flag_interrupted || system::Thread::self()->has_any_callbacks())
+    timeout_usec = 0;
+
+  struct __kernel_timespec timeout{};
+  timeout.tv_sec  = timeout_usec / 1000000;
+  timeout.tv_nsec = (timeout_usec % 1000000) * 1000;
+
+  int result = m_internal->enter(timeout_usec == 0 ? 0 : 1, IORING_ENTER_GETEVENTS, &timeout);
+
+  m_polling_state.fetch_and(~flag_state_mask, std::memory_order_release);
+
+  if (result == -1 && errno != ETIME)
+    return -1;
+
+  m_internal->reap();
+  m_internal->m_waiting_events = m_internal->m_events.size();
+
+  return m_internal->m_waiting_events;
+}
+
+void
+Poll::do_interrupt() {
+  int expected_state = flag_polling;
+
+  if (!m_polling_state.compare_exchange_strong(expected_state, flag_polling | flag_interrupted,
+                                               std::memory_order_release, std::memory_order_relaxed))
+    return;
+
+  m_internal->poke_user_event();
+}
+
+unsigned int
+Poll::process() {
+  unsigned int count{};
+
+  m_processing = true;
+  m_closed_events.clear();
+
+  for (size_t index = 0; index != m_internal->m_waiting_events; index++) {
+    if (system::Thread::self()->has_interrupt_callbacks())
+      system::Thread::self()->process_callbacks(true);
+
+    auto completion = m_internal->m_events[index];
+
+    if (completion.user_data == PollInternal::user_data_user_event) {
+      m_internal->clear_user_event();
+      m_internal->m_user_armed = false;
+      continue;
+    }
+
+    if (completion.user_data == PollInternal::user_data_remove)
+      continue;
+
+    auto poll_event = m_internal->take_armed(reinterpret_cast<PollEvent*>(completion.user_data));
+
+    if (poll_event->event == nullptr)
+      continue;
+
+    // Re-arm on the next flush, using the mask left by the handlers.
+    if (!poll_event->changed) {
+      poll_event->changed = true;
+      m_internal->m_changes.push_back(poll_event);
+    }
+
+    if (completion.result == -ECANCELED)
+      continue;
+
+    if (completion.result < 0)
+      throw internal_error("Poll::process() poll request failed: " + poll_event->event->print_name_fd_str() + " : " + std::string(std::strerror(-completion.result)));
+
+    auto events = static_cast<uint32_t>(completion.result);
+
+    // POLLERR is a pending socket error, e.g. a reset, so it is only an error event if the event
+    // asked for errors. A hangup on an event that doesn't read would complete every re-arm, so it
+    // goes to event_error.
+    bool is_error = (events & POLLERR) || ((events & POLLHUP) && !(poll_event->mask & PollInternal::flag_read));
+
+    if (is_error && (poll_event->mask & PollInternal::flag_error)) {
+      count++;
+
+      auto event_info = poll_event->event->print_name_fd_str();
+
+      poll_event->event->event_error();
+
+      if (poll_event->mask != 0)
+        throw internal_error("Poll::process() event_error called but event mask not cleared: " + event_info);
+
+      // We assume that the event gets closed if we get an error.
+      continue;
+    }
+
+    // Hangups are delivered as reads so that the event sees the end-of-file.
+    if ((events & (POLLIN | POLLHUP | POLLERR)) && (poll_event->mask & PollInternal::flag_read)) {
+      count++;
+      poll_event->event->event_read();
+    }
+    else if ((events & POLLIN)) {
+      LT_LOG_DEBUG_IDENT("spurious read event, skipping", 0);
+    }
+
+    if ((events & (POLLOUT | POLLERR)) && (poll_event->mask & PollInternal::flag_write)) {
+      count++;
+      poll_event->event->event_write();
+    }
+    else if ((events & POLLOUT)) {
+      LT_LOG_DEBUG_IDENT("spurious write event, skipping", 0);
+    }
+  }
+
+  m_closed_events.clear();
+  m_processing = false;
+
+  m_internal->m_events.clear();
+  m_internal->m_waiting_events = 0;
+
+  return count;
+}
+
+uint32_t
+Poll::open_max() const {
+  return m_internal->m_max_sockets;
+}
+
+void
+Poll::open(Event* event) {
+  LT_LOG_EVENT("open event", 0);
+
+  if (event->file_descriptor() == -1)
+    throw internal_error("Poll::open() invalid file descriptor for event: " + event->print_name_fd_str());
+
+  if (event->m_poll_event != nullptr)
+    throw internal_error("Poll::open() called but the event is already associated with a poll: " + event->print_name_fd_str());
+
+  if (m_internal->m_table.find(event->file_descriptor()) != m_internal->m_table.end())
+    throw internal_error("Poll::open() event already exists: " + event->print_name_fd_str());
+
+  event->m_poll_event = std::make_shared<PollEvent>(event);
+
+  m_internal->m_table[event->file_descriptor()] = event->m_poll_event;
+}
+
+void
+Poll::close(Event* event) {
+  LT_LOG_EVENT("close event", 0);
+
+  auto* poll_event = event->m_poll_event.get();
+
+  if (poll_event == nullptr)
+    return;
+
+  if (poll_event->event != event)
+    throw internal_error("Poll::close() event mismatch: " + event->print_name_fd_str());
+
+  if (m_internal->event_mask(event) != 0)
+    throw internal_error("Poll::close() called but the file descriptor is active: " + event->print_name_fd_str());
+
+  if (m_internal->m_table.erase(event->file_descriptor()) == 0)
+    throw internal_error("Poll::close() event not found: " + event->print_name_fd_str());
+
+  // Requests hold a reference to the file, so submit the removal now rather than at the next flush
+  // to release it when the caller closes the fd.
+  m_internal->flush_event(event->m_poll_event);
+  m_internal->submit();
+
+  if (m_processing)
+    m_closed_events.push_back(event->m_poll_event);
+
+  poll_event->event   = nullptr;
+  event->m_poll_event = nullptr;
+}
+
+bool
+Poll::in_read(Event* event) {
+  return m_internal->event_mask(event) & PollInternal::flag_read;
+}
+
+bool
+Poll::in_write(Event* event) {
+  return m_internal->event_mask(event) & PollInternal::flag_write;
+}
+
+bool
+Poll::in_error(Event* event) {
+  return m_internal->event_mask(event) & PollInternal::flag_error;
+}
+
+void
+Poll::insert_read(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (event_mask & PollInternal::flag_read)
+    return;
+
+  LT_LOG_EVENT("insert read", 0);
+
+  m_internal->set_event_mask(event, event_mask | PollInternal::flag_read);
+}
+
+void
+Poll::insert_write(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (event_mask & PollInternal::flag_write)
+    return;
+
+  LT_LOG_EVENT("insert write", 0);
+
+  m_internal->set_event_mask(event, event_mask | PollInternal::flag_write);
+}
+
+void
+Poll::insert_error(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (event_mask & PollInternal::flag_error)
+    return;
+
+  LT_LOG_EVENT("insert error", 0);
+
+  m_internal->set_event_mask(event, event_mask | PollInternal::flag_error);
+}
+
+void
+Poll::remove_read(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (!(event_mask & PollInternal::flag_read))
+    return;
+
+  LT_LOG_EVENT("remove read", 0);
+
+  m_internal->set_event_mask(event, event_mask & ~PollInternal::flag_read);
+}
+
+void
+Poll::remove_write(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (!(event_mask & PollInternal::flag_write))
+    return;
+
+  LT_LOG_EVENT("remove write", 0);
+
+  m_internal->set_event_mask(event, event_mask & ~PollInternal::flag_write);
+}
+
+void
+Poll::remove_error(Event* event) {
+  auto event_mask = m_internal->event_mask(event);
+
+  if (!(event_mask & PollInternal::flag_error))
+    return;
+
+  LT_LOG_EVENT("remove error", 0);
+
+  m_internal->set_event_mask(event, event_mask & ~PollInternal::flag_error);
+}
+
+void
+Poll::remove_and_close(Event* event) {
+  LT_LOG_EVENT("remove and close", 0);
+
+  remove_read(event);
+  remove_write(event);
+  remove_error(event);
+
+  close(event);
+}
+
+}
+
+#endif // USE_IO_URING